@@ -148,3 +148,27 @@ namespace async {
         (void) ((co_await tasks), ...);
     }
 }
+
+namespace async::detail {
+    // Coroutine that nobody awaits, its frame is destroyed when it finishes
+    struct detached {
+        struct promise_type {
+            detached get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    inline detached run_detached(task<void> t) {
+        co_await t;
+    }
+}
+
+namespace async {
+    // Runs a task in the background. The task must not throw.
+    inline void spawn(task<void> t) {
+        detail::run_detached(std::move(t));
+    }
+}
@@ -1,7 +1,15 @@
 #pragma once
 #include "udp_raw.h"
 #include "file.h"
+#include "event.h"
+#include "dns_client.h"
 #include <dns.h>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <list>
+#include <optional>
+#include <span>
 #include <unordered_map>
 
 namespace async::dns::detail::conf_parsing {
@@ -36,76 +44,590 @@ namespace async::dns::detail::conf_parsing {
 }
 
 namespace async::dns::detail {
-    inline task<std::string> parse_resolvconf() {
-        stream stream = co_await file::open_read("/etc/resolv.conf");
-        std::vector<std::string> ips;
+    struct resolv_conf {
+        std::vector<nameserver> nameservers;
+        resolver_options options;
+    };
+
+    // IPv6 nameservers are skipped, the client only speaks IPv4
+    inline task<resolv_conf> parse_resolvconf(std::string_view path = "/etc/resolv.conf") {
+        stream stream = co_await file::open_read(path);
+        resolv_conf conf;
+        const auto number = [] (std::string_view word, std::string_view prefix) -> std::optional<size_t> {
+            if (!word.starts_with(prefix)) { return std::nullopt; }
+            size_t n = 0;
+            auto [ptr, ec] = std::from_chars(word.data() + prefix.size(), word.data() + word.size(), n);
+            if (ec != std::errc() || ptr != word.data() + word.size()) { return std::nullopt; }
+            return n;
+        };
         try {
             while (true) {
                 std::string line = co_await stream.read_until("\n");
                 if (line.empty() || line.back() != '\n') { line.push_back('\n'); }
                 auto words = detail::conf_parsing::skip_line(line);
                 if (words.size() == 2 && words[0] == "nameserver") {
-                    ips.emplace_back(words[1]);
-                    for (auto& c : ips.back()) { c = tolower(c); }
+                    try {
+                        (void) c_api::inet_pton(AF_INET, words[1]);
+                        conf.nameservers.push_back({.ip = std::string(words[1]), .port = 53});
+                    } catch (const std::exception&) {}
+                } else if (words.size() > 1 && words[0] == "options") {
+                    // Same limits as glibc
+                    for (size_t i = 1; i < words.size(); i++) {
+                        if (auto n = number(words[i], "timeout:")) {
+                            conf.options.timeout_ms = std::clamp<size_t>(*n, 1, 30) * 1000.0;
+                        } else if (auto n = number(words[i], "attempts:")) {
+                            conf.options.attempts = std::clamp<size_t>(*n, 1, 5);
+                        } else if (words[i] == "rotate") {
+                            conf.options.rotate = true;
+                        }
+                    }
                 }
             }
         } catch (const c_api::eof&) {}
-        if (ips.empty()) {
+        if (conf.nameservers.empty()) {
             // This is what libc does
-            ips.emplace_back("127.0.0.1");
+            conf.nameservers.push_back({.ip = "127.0.0.1", .port = 53});
         }
-        co_return ips[0];
+        co_return conf;
     }
 
-    inline task<std::unordered_map<size_t, std::string>> parse_hosts() {
-        stream stream = co_await file::open_read("/etc/hosts");
-        std::unordered_map<size_t, std::string> host_to_ip;
-        try {
-            while (true) {
-                std::string line = co_await stream.read_until("\n");
-                if (line.empty() || line.back() != '\n') { line.push_back('\n'); }
-                auto words = detail::conf_parsing::skip_line(line);
-                if (words.size() > 1) {
-                    for (auto& c : line) { c = tolower(c); }
-                    try {
-                        for (size_t i = 1; i < words.size(); i++) {
-                            host_to_ip.emplace(std::hash<std::string_view>{}(words[i]), words[0]);
-                        }
-                    } catch (const std::exception&) {}
+    // /etc/hosts in one buffer of lowercase names and addresses, with open addressing
+    // tables from names to addresses and from addresses to their first name.
+    // Only IPv4 lines are indexed, like the rest of the resolver.
+    class hosts_file {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        explicit hosts_file(std::string path = "/etc/hosts") : path(std::move(path)) {}
+
+        // Reloads the file if its inode, size or mtime changed.
+        // stat() runs at most once per check_interval.
+        void check() {
+            const auto now = clock::now();
+            if (loaded && now < next_check) { return; }
+            next_check = now + check_interval;
+            struct stat st;
+            file_id current = {};
+            if (::stat(path.c_str(), &st) == 0) {
+                current = {st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+            }
+            if (loaded && current == id) { return; }
+            // A missing file is empty
+            if (current == file_id{}) {
+                load({});
+            } else {
+                try {
+                    load(c_api::mmap_file(path).view());
+                } catch (const std::exception&) {
+                    // Unreadable, keep the names loaded before and retry after check_interval
+                    if (loaded) { return; }
+                    load({});
+                    current = {};
                 }
-                words.clear();
             }
-        } catch (const c_api::eof&) {}
-        co_return host_to_ip;
+            id = current;
+            loaded = true;
+            reloads++;
+        }
+
+        // Case-insensitive
+        std::optional<std::string_view> find_ip(std::string_view host) const {
+            for (size_t i = hash(host) & (names.size() - 1); !names.empty() && names[i] != empty; i = (i + 1) & (names.size() - 1)) {
+                const auto& e = entries[names[i]];
+                if (::dns::detail::iequal(text(e.name_off, e.name_len), host)) {
+                    return text(e.ip_off, e.ip_len);
+                }
+            }
+            return std::nullopt;
+        }
+        // First name listed for ip
+        std::optional<std::string_view> find_host(std::string_view ip) const {
+            for (size_t i = hash(ip) & (ips.size() - 1); !ips.empty() && ips[i] != empty; i = (i + 1) & (ips.size() - 1)) {
+                const auto& e = entries[ips[i]];
+                if (text(e.ip_off, e.ip_len) == ip) {
+                    return text(e.name_off, e.name_len);
+                }
+            }
+            return std::nullopt;
+        }
+
+        void set_path(std::string p) {
+            path = std::move(p);
+            loaded = false;
+        }
+        size_t size() const { return entries.size(); }
+        size_t reload_count() const { return reloads; }
+
+        static constexpr auto check_interval = std::chrono::seconds(1);
+
+    private:
+        struct file_id {
+            dev_t dev;
+            ino_t ino;
+            off_t size;
+            time_t mtime_s;
+            long mtime_ns;
+            bool operator==(const file_id&) const = default;
+        };
+        struct entry {
+            uint32_t name_off;
+            uint32_t ip_off;
+            uint8_t name_len;
+            uint8_t ip_len;
+        };
+        static constexpr uint32_t empty = UINT32_MAX;
+
+        std::string_view text(uint32_t off, uint8_t len) const { return std::string_view(arena).substr(off, len); }
+
+        // FNV-1a over the lowercase string
+        static size_t hash(std::string_view s) {
+            size_t h = 0xcbf29ce484222325ull;
+            for (char c : s) {
+                h ^= static_cast<uint8_t>(::dns::detail::ascii_lower(c));
+                h *= 0x100000001b3ull;
+            }
+            return h;
+        }
+
+        static bool is_ipv4(std::string_view s) {
+            char buf[INET_ADDRSTRLEN];
+            if (s.size() >= sizeof(buf)) { return false; }
+            std::copy(s.begin(), s.end(), buf);
+            buf[s.size()] = '\0';
+            in_addr addr;
+            return ::inet_pton(AF_INET, buf, &addr) == 1;
+        }
+
+        void load(std::string_view data) {
+            arena.clear();
+            entries.clear();
+            arena.reserve(data.size());
+            using namespace conf_parsing;
+            size_t i = 0;
+            while (i < data.size()) {
+                const size_t eol = std::min(data.find('\n', i), data.size());
+                std::string_view line = data.substr(i, eol - i);
+                i = eol + 1;
+                line = line.substr(0, line.find('#'));
+                size_t pos = 0;
+                const auto next_word = [&] {
+                    while (pos < line.size() && is_ws(line[pos])) { pos++; }
+                    const size_t start = pos;
+                    while (pos < line.size() && !is_ws(line[pos]) && line[pos] != '\r') { pos++; }
+                    return line.substr(start, pos - start);
+                };
+                const std::string_view ip = next_word();
+                if (!is_ipv4(ip)) { continue; }
+                const uint32_t ip_off = arena.size();
+                arena.append(ip);
+                for (auto name = next_word(); !name.empty(); name = next_word()) {
+                    if (name.size() > ::dns::max_name_size) { continue; }
+                    entries.push_back({
+                        .name_off = static_cast<uint32_t>(arena.size()),
+                        .ip_off = ip_off,
+                        .name_len = static_cast<uint8_t>(name.size()),
+                        .ip_len = static_cast<uint8_t>(ip.size()),
+                    });
+                    for (char c : name) { arena.push_back(::dns::detail::ascii_lower(c)); }
+                }
+            }
+            size_t n_slots = 1;
+            while (n_slots < entries.size() * 2) { n_slots *= 2; }
+            names.assign(entries.empty() ? 0 : n_slots, empty);
+            ips.assign(entries.empty() ? 0 : n_slots, empty);
+            // Earlier lines win, like in libc
+            for (uint32_t idx = 0; idx < entries.size(); idx++) {
+                const auto& e = entries[idx];
+                insert(names, text(e.name_off, e.name_len), idx, [&] (const entry& o) {
+                    return text(o.name_off, o.name_len) == text(e.name_off, e.name_len);
+                });
+                insert(ips, text(e.ip_off, e.ip_len), idx, [&] (const entry& o) {
+                    return text(o.ip_off, o.ip_len) == text(e.ip_off, e.ip_len);
+                });
+            }
+        }
+
+        template <typename Same>
+        void insert(std::vector<uint32_t>& table, std::string_view key, uint32_t idx, Same same) {
+            size_t i = hash(key) & (table.size() - 1);
+            for (; table[i] != empty; i = (i + 1) & (table.size() - 1)) {
+                if (same(entries[table[i]])) { return; }
+            }
+            table[i] = idx;
+        }
+
+        std::string path;
+        bool loaded = false;
+        file_id id = {};
+        clock::time_point next_check;
+        size_t reloads = 0;
+        std::string arena;
+        std::vector<entry> entries;
+        // Indices into entries, empty marks a free slot
+        std::vector<uint32_t> names;
+        std::vector<uint32_t> ips;
+    };
+
+    inline std::string lowercase(std::string_view s) {
+        std::string ret {s};
+        for (auto& c : ret) { c = tolower(c); }
+        return ret;
+    }
+}
+
+namespace async::dns {
+    struct cache_options {
+        size_t capacity = 4096;
+        // Record TTLs are clamped to this range
+        uint32_t min_ttl_s = 5;
+        uint32_t max_ttl_s = 3600;
+        // Cap for NXDOMAIN / NODATA answers, which are cached for the
+        // SOA-derived TTL and not at all if the server sent no SOA
+        uint32_t max_negative_ttl_s = 300;
+        // Entries hit at least refresh_min_hits times are re-resolved in the background
+        // once this fraction of their TTL has elapsed, 0 disables
+        double refresh_at = 0.75;
+        size_t refresh_min_hits = 2;
+        // Background refreshes running at once, further ones are skipped
+        size_t refresh_budget = 8;
+    };
+
+    struct cache_stats {
+        size_t hits = 0;
+        size_t negative_hits = 0;
+        size_t misses = 0;
+        size_t expired = 0;
+        size_t evicted = 0;
+        // Lookups that waited for an identical one already in flight
+        size_t coalesced = 0;
+        size_t refreshes = 0;
+        size_t refresh_failures = 0;
+        // Over refresh_budget
+        size_t refreshes_skipped = 0;
+        // Background refreshes whose entry was hit again, each counted on its first hit
+        size_t hits_after_refresh = 0;
+        // Taken from snapshots by restore()
+        size_t restored = 0;
+        size_t size = 0;
+    };
+}
+
+namespace async::dns {
+    struct address {
+        std::string ip;
+        // AF_INET or AF_INET6
+        int family;
+        uint32_t ttl_s;
+    };
+
+    // Every A / AAAA record of a name, after following the CNAMEs in the responses
+    struct address_set {
+        std::string canonical_name;
+        std::vector<address> addresses;
+        // Smallest TTL of the addresses and the CNAMEs leading to them, 0 if there are none
+        uint32_t ttl_s = 0;
+    };
+}
+
+namespace async::dns::detail {
+    // Result of an A query. ip is empty for NXDOMAIN (rcode name_error) and NODATA (rcode no_error).
+    struct a_answer {
+        std::string ip;
+        ::dns::rcode_t rcode = ::dns::rcode_t::no_error;
+        // nullopt if the answer must not be cached
+        std::optional<uint32_t> ttl_s;
+    };
+
+    inline void throw_if_negative(const a_answer& ans) {
+        if (!ans.ip.empty()) { return; }
+        if (ans.rcode != ::dns::rcode_t::no_error) {
+            throw std::runtime_error("DNS server error: " + std::string(::dns::rcode_to_string(ans.rcode)));
+        }
+        throw ex::runtime("no valid answers in DNS response");
     }
 
+    struct inflight_query {
+        event done;
+        a_answer answer;
+        std::exception_ptr error;
+    };
+
+    // /etc/hosts is reloaded when it changes, DNS answers are kept in an LRU list
     class cache_t {
     public:
-        using cache_table_t = std::unordered_map<size_t, std::string>;
-        task<std::string_view> get_server_ip() {
-            if (dns_server_ip.empty()) {
-                dns_server_ip = co_await detail::parse_resolvconf();
+        using clock = std::chrono::steady_clock;
+
+        // Keep the returned pointer while querying, set_nameservers() may replace the set meanwhile
+        task<std::shared_ptr<nameserver_set>> get_nameservers() {
+            if (!nameservers) {
+                auto conf = co_await detail::parse_resolvconf();
+                // Another coroutine may have set them while the file was read
+                if (!nameservers) {
+                    nameservers = std::make_shared<nameserver_set>(conf.nameservers, conf.options);
+                }
             }
-            co_return dns_server_ip;
+            co_return nameservers;
+        }
+        void set_nameservers(const std::vector<nameserver>& servers, const resolver_options& options) {
+            nameservers = std::make_shared<nameserver_set>(servers, options);
+        }
+        // Shares another cache's set, e.g. from its get_nameservers()
+        void set_nameservers(std::shared_ptr<nameserver_set> servers) {
+            nameservers = std::move(servers);
+        }
+        std::optional<resolver_stats> nameserver_stats() const {
+            if (!nameservers) { return std::nullopt; }
+            return nameservers->stats();
         }
-        task<std::string> get_cache(size_t host_hash) {
-            if (!has_etchosts) {
-                cache_table.merge(co_await detail::parse_hosts());
-                has_etchosts = true;
+
+        // Reloaded first if the file changed
+        hosts_file& etc_hosts() {
+            hosts.check();
+            return hosts;
+        }
+
+        // host must be lowercase
+        task<std::optional<a_answer>> get_cache(const std::string& host) {
+            if (auto ip = etc_hosts().find_ip(host)) {
+                stats_.hits++;
+                co_return a_answer {.ip = std::string(*ip), .rcode = ::dns::rcode_t::no_error, .ttl_s = std::nullopt};
+            }
+            auto iter = index.find(host);
+            if (iter == index.end()) {
+                stats_.misses++;
+                co_return std::nullopt;
             }
-            auto iter = cache_table.find(host_hash);
-            if (iter != cache_table.end()) {
-                co_return iter->second;
+            if (iter->second->expires <= clock::now()) {
+                stats_.expired++;
+                stats_.misses++;
+                entries.erase(iter->second);
+                index.erase(iter);
+                co_return std::nullopt;
             }
-            co_return std::string();
+            entries.splice(entries.begin(), entries, iter->second);
+            if (iter->second->answer.ip.empty()) {
+                stats_.negative_hits++;
+            } else {
+                stats_.hits++;
+            }
+            iter->second->hits++;
+            if (iter->second->refreshed) {
+                iter->second->refreshed = false;
+                stats_.hits_after_refresh++;
+            }
+            co_return iter->second->answer;
+        }
+
+        // True if a hot entry is due for a refresh and one fits in the budget.
+        // The caller then runs detail::refresh().
+        bool start_refresh(const std::string& host) {
+            if (options.refresh_at == 0) { return false; }
+            auto iter = index.find(host);
+            if (iter == index.end()) { return false; }
+            entry& e = *iter->second;
+            if (e.refreshing || e.answer.ip.empty() || e.hits < options.refresh_min_hits) { return false; }
+            const auto now = clock::now();
+            if (now - e.stored < (e.expires - e.stored) * options.refresh_at) { return false; }
+            if (refreshes_running >= options.refresh_budget) {
+                stats_.refreshes_skipped++;
+                return false;
+            }
+            e.refreshing = true;
+            refreshes_running++;
+            stats_.refreshes++;
+            return true;
+        }
+
+        // answer is nullopt if the refresh failed, the entry then expires as usual
+        void finish_refresh(const std::string& host, std::optional<a_answer> answer) {
+            refreshes_running--;
+            if (answer) {
+                put_cache(host, std::move(*answer));
+            } else {
+                stats_.refresh_failures++;
+            }
+            if (auto iter = index.find(host); iter != index.end()) {
+                iter->second->refreshing = false;
+                iter->second->refreshed = answer.has_value() && iter->second->hits == 0;
+            }
+        }
+
+        void put_cache(const std::string& host, a_answer answer) {
+            if (!answer.ttl_s || options.capacity == 0) { return; }
+            uint32_t ttl_s;
+            if (answer.ip.empty()) {
+                ttl_s = std::min(*answer.ttl_s, options.max_negative_ttl_s);
+            } else {
+                ttl_s = std::clamp(*answer.ttl_s, options.min_ttl_s, options.max_ttl_s);
+            }
+            if (ttl_s == 0) { return; }
+            const auto now = clock::now();
+            const auto expires = now + std::chrono::seconds(ttl_s);
+            if (auto iter = index.find(host); iter != index.end()) {
+                iter->second->answer = std::move(answer);
+                iter->second->stored = now;
+                iter->second->expires = expires;
+                iter->second->hits = 0;
+                iter->second->refreshed = false;
+                entries.splice(entries.begin(), entries, iter->second);
+                return;
+            }
+            while (entries.size() >= options.capacity) {
+                index.erase(entries.back().host);
+                entries.pop_back();
+                stats_.evicted++;
+            }
+            entries.push_front({
+                .host = host,
+                .answer = std::move(answer),
+                .stored = now,
+                .expires = expires,
+                .hits = 0,
+                .refreshing = false,
+                .refreshed = false,
+            });
+            index.emplace(entries.front().host, entries.begin());
+        }
+
+        void set_options(const cache_options& o) {
+            options = o;
+            while (entries.size() > options.capacity) {
+                index.erase(entries.back().host);
+                entries.pop_back();
+                stats_.evicted++;
+            }
+        }
+        cache_stats stats() const {
+            auto ret = stats_;
+            ret.size = entries.size();
+            return ret;
+        }
+        void clear() {
+            entries.clear();
+            index.clear();
+        }
+
+        // Snapshot of the unexpired DNS entries, most recently used first.
+        // Integers are in host byte order, expiry times are wall clock so they survive a restart:
+        //   "adns", u32 version, u32 count,
+        //   count times: i64 expiry in ms since the Unix epoch, u8 rcode, u8 host size, u8 ip size, host, ip
+        std::string snapshot() const {
+            using namespace std::chrono;
+            const auto now = clock::now();
+            const auto wall_now = system_clock::now();
+            std::string ret(snapshot_header_size, '\0');
+            uint32_t count = 0;
+            for (const auto& e : entries) {
+                if (e.expires <= now || e.host.size() > UINT8_MAX || e.answer.ip.size() > UINT8_MAX) { continue; }
+                const auto wall_expires = wall_now + duration_cast<system_clock::duration>(e.expires - now);
+                const int64_t expires_ms = duration_cast<milliseconds>(wall_expires.time_since_epoch()).count();
+                ret.append(reinterpret_cast<const char*>(&expires_ms), sizeof(expires_ms));
+                ret.push_back(static_cast<char>(e.answer.rcode));
+                ret.push_back(static_cast<char>(e.host.size()));
+                ret.push_back(static_cast<char>(e.answer.ip.size()));
+                ret.append(e.host);
+                ret.append(e.answer.ip);
+                count++;
+            }
+            std::memcpy(ret.data(), snapshot_magic.data(), snapshot_magic.size());
+            std::memcpy(ret.data() + 4, &snapshot_version, sizeof(snapshot_version));
+            std::memcpy(ret.data() + 8, &count, sizeof(count));
+            return ret;
+        }
+
+        // Adds the unexpired entries of a snapshot() that aren't cached yet, behind the cached ones
+        // and up to capacity. Throws on a malformed snapshot. Returns the number of entries added.
+        size_t restore(std::string_view data) {
+            using namespace std::chrono;
+            uint32_t version, count;
+            if (data.size() < snapshot_header_size || data.substr(0, 4) != snapshot_magic) {
+                throw ex::runtime("not a DNS cache snapshot");
+            }
+            std::memcpy(&version, data.data() + 4, sizeof(version));
+            std::memcpy(&count, data.data() + 8, sizeof(count));
+            if (version != snapshot_version) {
+                throw ex::runtime("unsupported DNS cache snapshot version");
+            }
+            const auto now = clock::now();
+            const int64_t wall_now_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+            size_t pos = snapshot_header_size;
+            size_t added = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                constexpr size_t fixed_size = sizeof(int64_t) + 3;
+                if (data.size() - pos < fixed_size) {
+                    throw ex::runtime("truncated DNS cache snapshot");
+                }
+                int64_t expires_ms;
+                std::memcpy(&expires_ms, data.data() + pos, sizeof(expires_ms));
+                const auto rcode = static_cast<::dns::rcode_t>(data[pos + 8]);
+                const size_t host_size = static_cast<uint8_t>(data[pos + 9]);
+                const size_t ip_size = static_cast<uint8_t>(data[pos + 10]);
+                pos += fixed_size;
+                if (data.size() - pos < host_size + ip_size) {
+                    throw ex::runtime("truncated DNS cache snapshot");
+                }
+                const std::string_view host = data.substr(pos, host_size);
+                const std::string_view ip = data.substr(pos + host_size, ip_size);
+                pos += host_size + ip_size;
+                const int64_t left_ms = expires_ms - wall_now_ms;
+                if (left_ms <= 0 || entries.size() >= options.capacity || index.contains(host)) { continue; }
+                entries.push_back({
+                    .host = std::string(host),
+                    .answer = {.ip = std::string(ip), .rcode = rcode, .ttl_s = static_cast<uint32_t>((left_ms + 999) / 1000)},
+                    .stored = now,
+                    .expires = now + milliseconds(left_ms),
+                    .hits = 0,
+                    .refreshing = false,
+                    .refreshed = false,
+                });
+                index.emplace(entries.back().host, std::prev(entries.end()));
+                added++;
+            }
+            stats_.restored += added;
+            return added;
+        }
+
+        // Lookup of host that another coroutine is already making, or nullptr
+        std::shared_ptr<inflight_query> join_query(const std::string& host) {
+            auto iter = inflight.find(host);
+            if (iter == inflight.end()) { return nullptr; }
+            stats_.coalesced++;
+            return iter->second;
         }
-        void put_cache(size_t host_hash, std::string ip_str) {
-            cache_table.emplace(host_hash, ip_str);
+        std::shared_ptr<inflight_query> start_query(const std::string& host) {
+            auto query = std::make_shared<inflight_query>();
+            inflight.emplace(host, query);
+            return query;
         }
+        void finish_query(const std::string& host) { inflight.erase(host); }
+
     private:
-        std::string dns_server_ip;
-        bool has_etchosts = false;
-        cache_table_t cache_table;
+        static constexpr std::string_view snapshot_magic = "adns";
+        static constexpr uint32_t snapshot_version = 1;
+        static constexpr size_t snapshot_header_size = 12;
+
+        struct entry {
+            std::string host;
+            a_answer answer;
+            clock::time_point stored;
+            clock::time_point expires;
+            // Since stored
+            size_t hits;
+            bool refreshing;
+            // Put in place by a refresh and not hit since
+            bool refreshed;
+        };
+
+        std::shared_ptr<nameserver_set> nameservers;
+        hosts_file hosts;
+        cache_options options;
+        cache_stats stats_;
+        size_t refreshes_running = 0;
+        // Most recently used first
+        std::list<entry> entries;
+        std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+        // Lookups that haven't finished yet, by lowercase host
+        std::unordered_map<std::string, std::shared_ptr<inflight_query>> inflight;
     };
 
     // Used in host_to_ip() and ip_to_host()
@@ -113,70 +635,396 @@ namespace async::dns::detail {
 }
 
 namespace async::dns {
+    // Goes through the calling thread's udp_client, req.id is replaced
     inline task<::dns::packet_t> dns_query(std::string_view ip, const ::dns::packet_t& req) {
-        msgstream stream = co_await udp::detail::connect_udp_nolookup(ip, 53);
-        co_await stream.write(req.str());
-        while (true) {
-            ::dns::packet_t resp = ::dns::packet_t::from_string(co_await stream.read());
-            if (resp.flags.qr != 1) { continue; }
-            if (resp.id != req.id) { continue; }
-            co_return resp;
+        co_return co_await detail::shared_client.query(ip, req);
+    }
+}
+
+namespace async::dns::detail {
+    // Longer CNAME chains are treated as loops
+    inline constexpr size_t max_cname_hops = 16;
+
+    // The name host is an alias of according to the CNAMEs in resp, host if there are none.
+    // ttl_s is lowered to the smallest TTL along the chain.
+    inline std::string canonical_name(std::string_view host, const ::dns::packet_t& resp, uint32_t& ttl_s) {
+        std::string name(host);
+        for (size_t hop = 0; hop < max_cname_hops; hop++) {
+            auto iter = std::ranges::find_if(resp.answer_RRs, [&] (const auto& rr) {
+                return ::dns::is_CNAME_RR(rr) && ::dns::detail::iequal(rr.rname, name);
+            });
+            if (iter == resp.answer_RRs.end()) { break; }
+            ttl_s = std::min(ttl_s, iter->ttl);
+            name = ::dns::from_CNAME_RR(*iter);
         }
+        return name;
     }
 
-    inline task<std::string> lookup(std::string_view host, std::string_view dns_server_ip) {
-        ::dns::packet_t resp = co_await dns_query(dns_server_ip, ::dns::standard_query(host));
-        resp.throw_rcode();
-        uint32_t ip = -1;
-        for (const auto& ans : resp.answer_RRs) {
-            if (ans.rname != host) { continue; }
-            if (!::dns::is_A_RR(ans)) { continue; }
-            ip = ::dns::from_A_RR(ans);
-            break;
+    // Errors other than NXDOMAIN are thrown
+    inline a_answer a_answer_from(std::string_view host, const ::dns::packet_t& resp) {
+        if (resp.flags.rcode != ::dns::rcode_t::name_error) {
+            resp.throw_rcode();
+        }
+        a_answer ret {.ip = {}, .rcode = resp.flags.rcode, .ttl_s = std::nullopt};
+        if (resp.flags.rcode == ::dns::rcode_t::no_error) {
+            uint32_t chain_ttl_s = UINT32_MAX;
+            const std::string name = canonical_name(host, resp, chain_ttl_s);
+            for (const auto& ans : resp.answer_RRs) {
+                if (!::dns::is_A_RR(ans)) { continue; }
+                if (!::dns::detail::iequal(ans.rname, name)) { continue; }
+                ret.ip = c_api::inet_htop(AF_INET, ::dns::from_A_RR(ans));
+                ret.ttl_s = std::min(ans.ttl, chain_ttl_s);
+                return ret;
+            }
+        }
+        for (const auto& rr : resp.authority_RRs) {
+            if (::dns::is_SOA_RR(rr)) {
+                ret.ttl_s = ::dns::negative_ttl_from_SOA_RR(rr);
+                break;
+            }
         }
-        if (ip == -1u) { throw ex::runtime("no valid answers in DNS response"); }
-        std::string ip_str = c_api::inet_htop(AF_INET, ip);
-        co_return ip_str;
+        return ret;
     }
 
-    inline task<std::optional<std::string>> reverse_lookup(std::string_view ip, std::string_view dns_server_ip) {
-        ::dns::packet_t req = ::dns::reverse_query(ip);
-        ::dns::packet_t resp = co_await dns_query(dns_server_ip, req);
+    inline task<a_answer> query_a(std::string_view host, std::string_view dns_server_ip) {
+        co_return a_answer_from(host, co_await dns_query(dns_server_ip, ::dns::standard_query(host)));
+    }
+
+    // Re-resolves a cache entry after start_refresh(), doesn't throw
+    inline task<void> refresh(cache_t& cache, std::string host) {
+        std::optional<a_answer> answer;
+        try {
+            auto nameservers = co_await cache.get_nameservers();
+            answer = a_answer_from(host, co_await nameservers->query(::dns::standard_query(host)));
+        } catch (const std::exception&) {}
+        cache.finish_refresh(host, std::move(answer));
+    }
+
+    inline std::optional<std::string> ptr_from(const ::dns::packet_t& req, const ::dns::packet_t& resp) {
         if (resp.flags.rcode == ::dns::rcode_t::name_error) { // No such name
-            co_return std::nullopt;
+            return std::nullopt;
         }
         resp.throw_rcode();
-        co_return std::nullopt;
         for (const auto& ans : resp.answer_RRs) {
             if (!::dns::is_PTR_RR(ans)) { continue; }
             if (ans.rname != req.questions[0].qname) { continue; }
-            co_return ::dns::from_PTR_RR(ans);
+            return ::dns::from_PTR_RR(ans);
         }
         throw ex::runtime("no valid answers in DNS response");
     }
+}
 
-    // Lookup with /etc/hosts and cache. Noop if host is already an ip address.
-    inline task<std::string> host_to_ip(std::string_view host) {
+namespace async::dns::detail {
+    // Adds the A or AAAA records of the end of the CNAME chain, NXDOMAIN adds none.
+    // Other errors are thrown.
+    inline void add_addresses(std::string_view host, const ::dns::packet_t& resp, address_set& set) {
+        if (resp.flags.rcode == ::dns::rcode_t::name_error) { return; }
+        resp.throw_rcode();
+        uint32_t ttl_s = UINT32_MAX;
+        set.canonical_name = canonical_name(host, resp, ttl_s);
+        for (const auto& rr : resp.answer_RRs) {
+            if (!::dns::detail::iequal(rr.rname, set.canonical_name)) { continue; }
+            if (::dns::is_A_RR(rr)) {
+                set.addresses.push_back({c_api::inet_htop(AF_INET, ::dns::from_A_RR(rr)), AF_INET, std::min(rr.ttl, ttl_s)});
+            } else if (::dns::is_AAAA_RR(rr)) {
+                set.addresses.push_back({c_api::inet_ntop6(rr.rdata.data()), AF_INET6, std::min(rr.ttl, ttl_s)});
+            }
+        }
+    }
+
+    // family is AF_INET, AF_INET6 or AF_UNSPEC for both, which are then queried concurrently.
+    // A failed query is only thrown if the other one failed too.
+    inline task<address_set> lookup_addresses(nameserver_set& nameservers, std::string_view host, int family) {
+        address_set ret {.canonical_name = std::string(host), .addresses = {}, .ttl_s = 0};
+        std::vector<task<::dns::packet_t>> queries;
+        if (family != AF_INET6) {
+            queries.push_back(nameservers.query(::dns::standard_query(host, 1)));
+        }
+        if (family != AF_INET) {
+            queries.push_back(nameservers.query(::dns::standard_query(host, 28)));
+        }
+        std::exception_ptr error;
+        size_t failed = 0;
+        // Every task is awaited before anything is thrown
+        for (auto& query : queries) {
+            try {
+                add_addresses(host, co_await query, ret);
+            } catch (...) {
+                error = std::current_exception();
+                failed++;
+            }
+        }
+        if (failed == queries.size()) { std::rethrow_exception(error); }
+        if (!ret.addresses.empty()) {
+            ret.ttl_s = std::ranges::min(ret.addresses, {}, &address::ttl_s).ttl_s;
+        }
+        co_return ret;
+    }
+}
+
+namespace async::dns::detail {
+    // host_to_ip() without throwing on NXDOMAIN and NODATA
+    inline task<a_answer> resolve_a(cache_t& cache, std::string_view host) {
         // Return as is if host is already an ip address
         try {
             (void) c_api::inet_pton(AF_INET, host);
-            co_return std::string(host);
+            co_return a_answer {.ip = std::string(host), .rcode = ::dns::rcode_t::no_error, .ttl_s = std::nullopt};
         } catch (std::exception&) {}
 
         // Lookup in cache
-        const size_t host_hash = std::hash<std::string_view>{}(host);
-        if (auto s = co_await detail::cache.get_cache(host_hash); !s.empty()) {
-            co_return s;
+        const std::string key = lowercase(host);
+        if (auto cached = co_await cache.get_cache(key)) {
+            if (cache.start_refresh(key)) {
+                spawn(refresh(cache, key));
+            }
+            co_return std::move(*cached);
+        }
+
+        // Wait for the same lookup if another coroutine is already making it
+        if (auto query = cache.join_query(key)) {
+            co_await query->done.wait();
+            if (query->error) { std::rethrow_exception(query->error); }
+            co_return query->answer;
         }
 
         // Make a DNS request
-        auto dns_server_ip = co_await detail::cache.get_server_ip();
-        std::string ip_str = co_await lookup(host, dns_server_ip);
-        detail::cache.put_cache(host_hash, ip_str);
-        co_return ip_str;
+        auto query = cache.start_query(key);
+        try {
+            auto nameservers = co_await cache.get_nameservers();
+            query->answer = a_answer_from(host, co_await nameservers->query(::dns::standard_query(host)));
+            cache.put_cache(key, query->answer);
+        } catch (...) {
+            query->error = std::current_exception();
+        }
+        cache.finish_query(key);
+        query->done.set();
+        if (query->error) { std::rethrow_exception(query->error); }
+        co_return query->answer;
+    }
+}
+
+namespace async::dns {
+
+    inline task<std::string> lookup(std::string_view host, std::string_view dns_server_ip) {
+        detail::a_answer ans = co_await detail::query_a(host, dns_server_ip);
+        detail::throw_if_negative(ans);
+        co_return ans.ip;
+    }
+
+    inline task<std::optional<std::string>> reverse_lookup(std::string_view ip, std::string_view dns_server_ip) {
+        ::dns::packet_t req = ::dns::reverse_query(ip);
+        co_return detail::ptr_from(req, co_await dns_query(dns_server_ip, req));
+    }
+
+    // Lookup with /etc/hosts and cache. Noop if host is already an ip address.
+    inline task<std::string> host_to_ip(std::string_view host) {
+        detail::a_answer ans = co_await detail::resolve_a(detail::cache, host);
+        detail::throw_if_negative(ans);
+        co_return ans.ip;
+    }
+
+    // All addresses of host, family is AF_INET, AF_INET6 or AF_UNSPEC for both.
+    // Ip addresses and /etc/hosts names give a single address with TTL 0. Not cached.
+    inline task<address_set> lookup_all(std::string_view host, int family = AF_UNSPEC) {
+        const auto single = [&] (std::string_view ip, int ip_family) {
+            return address_set {.canonical_name = std::string(host), .addresses = {{std::string(ip), ip_family, 0}}, .ttl_s = 0};
+        };
+        try {
+            if (host.find(':') != std::string_view::npos) {
+                (void) c_api::inet_pton6(host);
+                co_return single(host, AF_INET6);
+            }
+            (void) c_api::inet_pton(AF_INET, host);
+            co_return single(host, AF_INET);
+        } catch (std::exception&) {}
+        if (family != AF_INET6) {
+            if (auto ip = detail::cache.etc_hosts().find_ip(host)) {
+                co_return single(*ip, AF_INET);
+            }
+        }
+        auto nameservers = co_await detail::cache.get_nameservers();
+        co_return co_await detail::lookup_addresses(*nameservers, host, family);
     }
 
+    // Tries /etc/hosts first
     inline task<std::optional<std::string>> ip_to_host(std::string_view ip) {
-        co_return co_await reverse_lookup(ip, co_await detail::cache.get_server_ip());
+        if (auto host = detail::cache.etc_hosts().find_host(ip)) {
+            co_return std::string(*host);
+        }
+        ::dns::packet_t req = ::dns::reverse_query(ip);
+        auto nameservers = co_await detail::cache.get_nameservers();
+        co_return detail::ptr_from(req, co_await nameservers->query(req));
+    }
+
+    // Applies to the calling thread's cache
+    inline void set_cache_options(const cache_options& options) { detail::cache.set_options(options); }
+    inline cache_stats get_cache_stats() { return detail::cache.stats(); }
+    inline void clear_cache() { detail::cache.clear(); }
+    // Replaces the nameservers from resolv.conf
+    inline void set_nameservers(const std::vector<nameserver>& servers, const resolver_options& options = {}) {
+        detail::cache.set_nameservers(servers, options);
+    }
+    // nullopt before the first lookup
+    inline std::optional<resolver_stats> get_resolver_stats() { return detail::cache.nameserver_stats(); }
+
+    // Writes a snapshot of cache, replacing path atomically
+    inline task<void> save_cache(detail::cache_t& cache, std::string_view path) {
+        const std::string data = cache.snapshot();
+        const std::string tmp_path = std::string(path) + ".tmp";
+        async::stream stream = co_await file::open_write(tmp_path, false);
+        co_await stream.write(data);
+        co_await stream.close();
+        ex::wrape(::rename(tmp_path.c_str(), std::string(path).c_str()), "rename()");
+    }
+    // The thread's cache
+    inline task<void> save_cache(std::string_view path) {
+        co_await save_cache(detail::cache, path);
+    }
+    // Call at startup, before the first lookups. A missing file loads nothing.
+    // Returns the number of entries loaded, expired ones are skipped.
+    inline size_t load_cache(detail::cache_t& cache, std::string_view path) {
+        struct stat st;
+        if (::stat(std::string(path).c_str(), &st) != 0) { return 0; }
+        return cache.restore(c_api::mmap_file(path).view());
+    }
+    inline size_t load_cache(std::string_view path) { return load_cache(detail::cache, path); }
+    // Saves cache every interval_ms, and once more when stop is set
+    inline task<void> persist_cache(detail::cache_t& cache, std::string path, double interval_ms, event& stop) {
+        while (true) {
+            const bool stopped = co_await stop.wait_for(interval_ms);
+            co_await save_cache(cache, path);
+            if (stopped) { break; }
+        }
+    }
+    // The thread's cache
+    inline task<void> persist_cache(std::string path, double interval_ms, event& stop) {
+        co_await persist_cache(detail::cache, std::move(path), interval_ms, stop);
+    }
+}
+
+namespace async::dns {
+    struct batch_result {
+        // Position in the input
+        size_t index;
+        std::string_view host;
+        // Empty for NXDOMAIN (rcode name_error), NODATA (rcode no_error) and errors
+        std::string ip;
+        ::dns::rcode_t rcode = ::dns::rcode_t::no_error;
+        // c_api::timeout after all retries, SERVFAIL, socket errors
+        std::exception_ptr error;
+    };
+
+    struct batch_stats {
+        size_t hosts = 0;
+        size_t resolved = 0;
+        // NXDOMAIN or NODATA
+        size_t negative = 0;
+        size_t failed = 0;
+        // Lookups started again after a timeout
+        size_t retried = 0;
+        // Of the calling thread's udp_client while the batch ran, other lookups included
+        size_t sent = 0;
+        size_t lost = 0;
+        double elapsed_ms = 0;
+
+        double qps() const { return elapsed_ms > 0 ? hosts * 1000 / elapsed_ms : 0; }
+        // Share of sent queries that were retransmitted or timed out
+        double loss_rate() const { return sent != 0 ? static_cast<double>(lost) / sent : 0; }
+    };
+}
+
+namespace async::dns::detail {
+    struct batch_state {
+        std::span<const std::string_view> hosts;
+        size_t retries;
+        size_t next = 0;
+        batch_stats stats;
+        std::exception_ptr handler_error;
+    };
+
+    // Takes the next host until none are left, doesn't throw
+    template <typename Handler>
+    task<void> batch_worker(cache_t& cache, batch_state& state, Handler& on_result) {
+        while (state.next < state.hosts.size() && !state.handler_error) {
+            batch_result result {.index = state.next, .host = state.hosts[state.next], .ip = {}, .rcode = {}, .error = nullptr};
+            state.next++;
+            for (size_t attempt = 0; ; attempt++) {
+                try {
+                    a_answer ans = co_await resolve_a(cache, result.host);
+                    result.ip = std::move(ans.ip);
+                    result.rcode = ans.rcode;
+                    result.error = nullptr;
+                    break;
+                } catch (const c_api::timeout&) {
+                    result.error = std::current_exception();
+                } catch (...) {
+                    result.error = std::current_exception();
+                    break;
+                }
+                if (attempt == state.retries) { break; }
+                state.stats.retried++;
+            }
+            if (result.error) {
+                state.stats.failed++;
+            } else if (result.ip.empty()) {
+                state.stats.negative++;
+            } else {
+                state.stats.resolved++;
+            }
+            try {
+                on_result(std::as_const(result));
+            } catch (...) {
+                state.handler_error = std::current_exception();
+            }
+        }
+    }
+
+    template <typename Handler>
+    task<batch_stats> resolve_batch(cache_t& cache, std::span<const std::string_view> hosts, size_t concurrency,
+                                    Handler on_result, size_t retries) {
+        const auto start = poll_loop_t::clock::now();
+        const client_stats before = shared_client.stats();
+        batch_state state {.hosts = hosts, .retries = retries, .next = 0, .stats = {}, .handler_error = nullptr};
+        state.stats.hosts = hosts.size();
+        // Tasks start eagerly, so the workers run concurrently and are only collected here
+        std::vector<task<void>> workers;
+        for (size_t i = 0; i < std::min(std::max<size_t>(concurrency, 1), hosts.size()); i++) {
+            workers.push_back(batch_worker(cache, state, on_result));
+        }
+        for (auto& worker : workers) {
+            co_await worker;
+        }
+        if (state.handler_error) { std::rethrow_exception(state.handler_error); }
+        const client_stats& after = shared_client.stats();
+        state.stats.sent = after.sent - before.sent;
+        state.stats.lost = (after.retransmits - before.retransmits) + (after.timeouts - before.timeouts);
+        state.stats.elapsed_ms = std::chrono::duration<double, std::milli>(poll_loop_t::clock::now() - start).count();
+        co_return state.stats;
+    }
+}
+
+namespace async::dns {
+    // Resolves many hosts like host_to_ip() with up to concurrency lookups in flight,
+    // all pipelined over the thread's shared UDP sockets.
+    // on_result(const batch_result&) is called as each host finishes, in completion order.
+    // Hosts that time out are looked up again up to retries times.
+    // An exception from on_result stops the batch and is rethrown once the running lookups finish.
+    // Answers go to cache, which must outlive any refreshes its hits start.
+    template <typename Handler>
+    task<batch_stats> resolve_many(detail::cache_t& cache, std::span<const std::string_view> hosts, size_t concurrency,
+                                   Handler on_result, size_t retries = 1) {
+        co_return co_await detail::resolve_batch(cache, hosts, concurrency, std::move(on_result), retries);
+    }
+
+    // As above with a cache of its own for the batch, so a large one-off batch doesn't
+    // evict the thread's hot entries. Uses the thread's nameservers.
+    template <typename Handler>
+    task<batch_stats> resolve_many(std::span<const std::string_view> hosts, size_t concurrency, Handler on_result,
+                                   size_t retries = 1) {
+        detail::cache_t batch_cache;
+        // Refreshes would outlive the batch
+        batch_cache.set_options({.refresh_at = 0});
+        batch_cache.set_nameservers(co_await detail::cache.get_nameservers());
+        co_return co_await detail::resolve_batch(batch_cache, hosts, concurrency, std::move(on_result), retries);
     }
 }
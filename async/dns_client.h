@@ -0,0 +1,509 @@
+#pragma once
+#include "coro.h"
+#include "poll_loop.h"
+#include "posix_wrappers.h"
+#include "event.h"
+#include <dns.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+namespace async::dns {
+    struct client_options {
+        // Queries are spread over this many sockets
+        size_t sockets = 4;
+        // A socket is replaced after this many queries, so the source port keeps changing
+        size_t queries_per_socket = 256;
+        double timeout_ms = 1000;
+        // Sends per query, including the first one
+        size_t attempts = 3;
+    };
+
+    struct client_stats {
+        size_t sent = 0;
+        size_t retransmits = 0;
+        size_t timeouts = 0;
+        size_t received = 0;
+        // Dropped responses: unknown id, wrong source address or question, malformed
+        size_t mismatched = 0;
+        size_t sockets_opened = 0;
+    };
+}
+
+namespace async::dns::detail {
+    // Lives in the frame of the querying coroutine
+    struct pending_query {
+        uint16_t id;
+        sockaddr_in server;
+        std::string qname;
+        uint16_t qtype;
+        poll_loop_t::clock::time_point deadline;
+        // As received, checked to be well-formed
+        std::optional<std::string> response;
+        std::exception_ptr error;
+        bool timed_out = false;
+        std::coroutine_handle<> waiter;
+    };
+
+    struct socket_slot {
+        c_api::fd fd;
+        size_t uses = 0;
+        bool reader_running = false;
+        // Deadline of the reader's current wait, lowered when a query needs an earlier wakeup
+        poll_loop_t::clock::time_point* reader_deadline = nullptr;
+        std::unordered_map<uint16_t, pending_query*> pending;
+    };
+
+    // Takes a query out of its socket's table when the querying coroutine leaves,
+    // unless the reader already did and the id has been reused since
+    struct pending_registration {
+        socket_slot& slot;
+        pending_query& q;
+        ~pending_registration() {
+            auto iter = slot.pending.find(q.id);
+            if (iter != slot.pending.end() && iter->second == &q) {
+                slot.pending.erase(iter);
+            }
+        }
+    };
+
+    // Suspends until the socket reader fills in a response, an error or a timeout
+    struct query_awaiter {
+        bool await_ready() const noexcept { return q.response || q.error || q.timed_out; }
+        void await_suspend(std::coroutine_handle<> h) noexcept { q.waiter = h; }
+        void await_resume() const noexcept {}
+        pending_query& q;
+    };
+}
+
+namespace async::dns {
+    // Sends queries over a few long-lived UDP sockets and routes responses by id.
+    // Each socket has a reader coroutine while it has queries outstanding.
+    class udp_client {
+    public:
+        explicit udp_client(client_options options = {}) { set_options(options); }
+        udp_client(const udp_client&) = delete;
+
+        // Retransmits after timeout_ms, throws c_api::timeout after the last attempt
+        task<::dns::packet_t> query(std::string_view server_ip, ::dns::packet_t req, uint16_t port = 53) {
+            return query(c_api::make_sockaddr_in(server_ip, port), std::move(req), options.timeout_ms, options.attempts);
+        }
+
+        task<::dns::packet_t> query(sockaddr_in server, ::dns::packet_t req, double timeout_ms, size_t attempts) {
+            const std::string resp = co_await query_raw(server, std::move(req), timeout_ms, attempts);
+            co_return ::dns::packet_t::from_string(resp);
+        }
+
+        // The response as the server sent it, for forwarding without re-encoding
+        task<std::string> query_raw(std::string_view server_ip, ::dns::packet_t req, uint16_t port = 53) {
+            return query_raw(c_api::make_sockaddr_in(server_ip, port), std::move(req), options.timeout_ms, options.attempts);
+        }
+
+        task<std::string> query_raw(sockaddr_in server, ::dns::packet_t req, double timeout_ms, size_t attempts) {
+            if (req.questions.size() != 1) {
+                throw ex::runtime("DNS queries must have exactly one question");
+            }
+            auto slot = pick_slot();
+            detail::pending_query q {
+                .id = unused_id(*slot),
+                .server = server,
+                .qname = req.questions[0].qname,
+                .qtype = req.questions[0].qtype,
+                .deadline = {},
+                .response = std::nullopt,
+                .error = nullptr,
+                .timed_out = false,
+                .waiter = nullptr,
+            };
+            req.id = q.id;
+            const std::string wire = req.str();
+            // Stays registered across retransmits, so a late answer to an earlier send still counts
+            const detail::pending_registration registration {*slot, q};
+            for (size_t attempt = 0; attempt < attempts; attempt++) {
+                if (attempt != 0) { stats_.retransmits++; }
+                // Set before anything suspends: the reader resumes this coroutine
+                // on a timeout and then waits for the new deadline
+                q.timed_out = false;
+                q.deadline = poll_loop_t::clock::now() + std::chrono::duration_cast<poll_loop_t::clock::duration>(
+                    std::chrono::duration<double, std::milli>(timeout_ms));
+                if (attempt == 0) {
+                    slot->pending.emplace(q.id, &q);
+                    if (!slot->reader_running) {
+                        slot->reader_running = true;
+                        spawn(read_loop(slot));
+                    }
+                }
+                if (slot->reader_deadline && q.deadline < *slot->reader_deadline) {
+                    *slot->reader_deadline = q.deadline;
+                }
+                co_await send(*slot, wire, q.server);
+                co_await detail::query_awaiter{q};
+                if (q.error) { std::rethrow_exception(q.error); }
+                if (q.response) { co_return std::move(*q.response); }
+            }
+            stats_.timeouts++;
+            throw c_api::timeout();
+        }
+
+        const client_stats& stats() const { return stats_; }
+        // Applies to sockets opened from now on
+        void set_options(const client_options& o) {
+            if (o.sockets == 0) {
+                throw ex::runtime("DNS client needs at least one socket");
+            }
+            options = o;
+        }
+
+    private:
+        std::shared_ptr<detail::socket_slot> pick_slot() {
+            if (slots.size() != options.sockets) {
+                slots.resize(options.sockets);
+            }
+            next_slot = (next_slot + 1) % slots.size();
+            auto& slot = slots[next_slot];
+            if (!slot || slot->uses >= options.queries_per_socket) {
+                // The old socket stays open while its reader has queries outstanding
+                slot = std::make_shared<detail::socket_slot>(c_api::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP));
+                stats_.sockets_opened++;
+            }
+            slot->uses++;
+            return slot;
+        }
+
+        static uint16_t unused_id(const detail::socket_slot& slot) {
+            while (true) {
+                uint16_t id = ::dns::random_id();
+                if (!slot.pending.contains(id)) { return id; }
+            }
+        }
+
+        task<void> send(detail::socket_slot& slot, std::string_view wire, const sockaddr_in& server) {
+            while (c_api::sendto(slot.fd, wire, server) == 0) {
+                co_await poll_loop.wait_write(slot.fd);
+            }
+            stats_.sent++;
+        }
+
+        // Runs while the socket has queries outstanding, must not throw
+        task<void> read_loop(std::shared_ptr<detail::socket_slot> slot) {
+            std::vector<detail::pending_query*> done;
+            std::string buf(65536, '\0');
+            try {
+                while (!slot->pending.empty()) {
+                    // Timed out queries get a new deadline when they retransmit
+                    auto deadline = poll_loop_t::clock::time_point::max();
+                    for (const auto& [id, q] : slot->pending) {
+                        if (!q->timed_out) { deadline = std::min(deadline, q->deadline); }
+                    }
+                    auto wait = poll_loop.wait_read_until(slot->fd, deadline);
+                    slot->reader_deadline = &wait.deadline;
+                    const bool readable = co_await wait;
+                    slot->reader_deadline = nullptr;
+                    if (readable) {
+                        receive(*slot, buf, done);
+                    }
+                    // Timed out queries stay registered, they either retransmit with
+                    // a new deadline or leave the table when they give up
+                    const auto now = poll_loop_t::clock::now();
+                    for (const auto& [id, q] : slot->pending) {
+                        if (q->deadline <= now && !q->timed_out) {
+                            q->timed_out = true;
+                            done.push_back(q);
+                        }
+                    }
+                    wake(done);
+                }
+            } catch (...) {
+                slot->reader_deadline = nullptr;
+                for (const auto& [id, q] : slot->pending) {
+                    q->error = std::current_exception();
+                    done.push_back(q);
+                }
+                slot->pending.clear();
+                wake(done);
+            }
+            slot->reader_running = false;
+        }
+
+        void receive(detail::socket_slot& slot, std::string& buf, std::vector<detail::pending_query*>& done) {
+            sockaddr_in from;
+            while (auto n_read = c_api::recvfrom(slot.fd, buf.data(), buf.size(), from)) {
+                stats_.received++;
+                const std::string_view packet = std::string_view(buf).substr(0, *n_read);
+                // Stray and spoofed responses are dropped without being decoded
+                auto iter = slot.pending.end();
+                try {
+                    ::dns::message_view view(packet);
+                    iter = slot.pending.find(view.id());
+                    if (iter != slot.pending.end() && matches(*iter->second, from, view)) {
+                        // Malformed ones are dropped like strays
+                        for (::dns::record_view rr; view.next_record(rr); ) {}
+                        iter->second->response = std::string(packet);
+                    } else {
+                        iter = slot.pending.end();
+                    }
+                } catch (const std::exception&) {
+                    iter = slot.pending.end();
+                }
+                if (iter == slot.pending.end()) {
+                    stats_.mismatched++;
+                    continue;
+                }
+                done.push_back(iter->second);
+                slot.pending.erase(iter);
+            }
+        }
+
+        static bool matches(const detail::pending_query& q, const sockaddr_in& from, ::dns::message_view& view) {
+            ::dns::question_view question;
+            return c_api::same_address(q.server, from)
+                && view.flags().qr == 1
+                && view.count(::dns::section_t::question) == 1
+                && view.next_question(question)
+                && question.qtype == q.qtype
+                && view.name_equals(question.name_offset, q.qname);
+        }
+
+        // Waiters may start new queries, so the table isn't touched while resuming
+        static void wake(std::vector<detail::pending_query*>& done) {
+            auto to_wake = std::move(done);
+            done.clear();
+            for (auto* q : to_wake) {
+                if (auto h = std::exchange(q->waiter, nullptr)) {
+                    h.resume();
+                }
+            }
+        }
+
+        client_options options;
+        client_stats stats_;
+        std::vector<std::shared_ptr<detail::socket_slot>> slots;
+        size_t next_slot = 0;
+    };
+}
+
+namespace async::dns::detail {
+    // Used by dns_query()
+    inline thread_local udp_client shared_client;
+}
+
+namespace async::dns {
+    // Applies to the calling thread's client
+    inline void set_client_options(const client_options& options) { detail::shared_client.set_options(options); }
+    inline const client_stats& get_client_stats() { return detail::shared_client.stats(); }
+}
+
+namespace async::dns {
+    struct nameserver {
+        std::string ip;
+        uint16_t port = 53;
+    };
+
+    struct resolver_options {
+        // Per server and attempt. resolv.conf `options timeout:`
+        double timeout_ms = 5000;
+        // Rounds over all servers. resolv.conf `options attempts:`
+        size_t attempts = 2;
+        // Start each query at the next server instead of the fastest one. resolv.conf `options rotate`
+        bool rotate = false;
+        // The next server is also queried if the current one hasn't answered
+        // within its expected RTT (srtt + 4 * rttvar), clamped to this range
+        double hedge_min_ms = 20;
+        double hedge_max_ms = 1000;
+        // Assumed RTT of servers that haven't answered yet
+        double initial_rtt_ms = 100;
+    };
+
+    struct nameserver_stats {
+        std::string ip;
+        uint16_t port;
+        double srtt_ms;
+        size_t queries = 0;
+        size_t answers = 0;
+        size_t timeouts = 0;
+        // SERVFAIL, REFUSED or socket errors
+        size_t failures = 0;
+    };
+
+    struct resolver_stats {
+        size_t queries = 0;
+        // A server was queried while another was still pending
+        size_t hedged = 0;
+        // A server was queried after another one failed or timed out
+        size_t failovers = 0;
+        std::vector<nameserver_stats> servers;
+    };
+}
+
+namespace async::dns::detail {
+    struct nameserver_state {
+        nameserver_stats stats;
+        sockaddr_in address;
+        double rttvar_ms;
+        bool measured = false;
+
+        void on_answer(double rtt_ms) {
+            stats.answers++;
+            if (!measured) {
+                stats.srtt_ms = rtt_ms;
+                rttvar_ms = rtt_ms / 2;
+                measured = true;
+                return;
+            }
+            rttvar_ms = 0.75 * rttvar_ms + 0.25 * std::abs(stats.srtt_ms - rtt_ms);
+            stats.srtt_ms = 0.875 * stats.srtt_ms + 0.125 * rtt_ms;
+        }
+        // Pushes the server back in the ranking, decay() brings it forward again
+        void on_failure(double timeout_ms) {
+            stats.srtt_ms = std::min(std::max(stats.srtt_ms * 2, 1.0), timeout_ms * 4);
+            rttvar_ms = std::max(rttvar_ms, stats.srtt_ms / 2);
+        }
+        // Servers that aren't picked slowly look faster, so a recovered one gets retried
+        void decay() { stats.srtt_ms *= 0.98; }
+
+        double hedge_delay_ms(const resolver_options& options) const {
+            return std::clamp(stats.srtt_ms + 4 * rttvar_ms, options.hedge_min_ms, options.hedge_max_ms);
+        }
+    };
+
+    // Shared by a resolve() call and the per-server queries it started, which may outlive it
+    struct race_state {
+        event done;
+        std::optional<std::string> answer;
+        std::exception_ptr error;
+        size_t running = 0;
+    };
+
+    inline bool is_server_failure(::dns::rcode_t rcode) {
+        return rcode == ::dns::rcode_t::server_failure || rcode == ::dns::rcode_t::refused;
+    }
+}
+
+namespace async::dns {
+    // The nameservers of resolv.conf with RTT tracking.
+    // Queries go to the fastest server first, then race the next one if the answer is late,
+    // and move on to the next one on timeout or SERVFAIL / REFUSED.
+    class nameserver_set {
+    public:
+        nameserver_set(const std::vector<nameserver>& servers, resolver_options options = {}) : options(options) {
+            if (servers.empty()) {
+                throw ex::runtime("no nameservers");
+            }
+            for (const auto& ns : servers) {
+                auto state = std::make_shared<detail::nameserver_state>();
+                state->stats.ip = ns.ip;
+                state->stats.port = ns.port;
+                state->stats.srtt_ms = options.initial_rtt_ms;
+                state->address = c_api::make_sockaddr_in(ns.ip, ns.port);
+                state->rttvar_ms = options.initial_rtt_ms / 2;
+                this->servers.push_back(std::move(state));
+            }
+        }
+        nameserver_set(const nameserver_set&) = delete;
+
+        // Throws the last server's error, c_api::timeout if all of them timed out
+        task<::dns::packet_t> query(::dns::packet_t req) {
+            const std::string resp = co_await query_raw(std::move(req));
+            co_return ::dns::packet_t::from_string(resp);
+        }
+
+        // The answer as the server sent it
+        task<std::string> query_raw(::dns::packet_t req) {
+            stats_.queries++;
+            const auto order = ranked();
+            const size_t total = order.size() * std::max<size_t>(options.attempts, 1);
+            auto race = std::make_shared<detail::race_state>();
+            size_t next = 0;
+            auto hedge_at = poll_loop_t::clock::now();
+            while (!race->answer) {
+                const auto now = poll_loop_t::clock::now();
+                if (next < total && (race->running == 0 || now >= hedge_at)) {
+                    if (race->running != 0) {
+                        stats_.hedged++;
+                    } else if (next != 0) {
+                        stats_.failovers++;
+                    }
+                    const auto& ns = order[next % order.size()];
+                    next++;
+                    race->running++;
+                    hedge_at = now + std::chrono::duration_cast<poll_loop_t::clock::duration>(
+                        std::chrono::duration<double, std::milli>(ns->hedge_delay_ms(options)));
+                    spawn(query_server(race, ns, req, options.timeout_ms));
+                    continue;
+                }
+                if (race->running == 0) {
+                    std::rethrow_exception(race->error);
+                }
+                race->done.reset();
+                if (next < total) {
+                    co_await race->done.wait_for(std::chrono::duration<double, std::milli>(hedge_at - now).count());
+                } else {
+                    co_await race->done.wait();
+                }
+            }
+            co_return std::move(*race->answer);
+        }
+
+        resolver_stats stats() const {
+            resolver_stats ret = stats_;
+            for (const auto& ns : servers) {
+                ret.servers.push_back(ns->stats);
+            }
+            return ret;
+        }
+        const resolver_options& get_options() const { return options; }
+
+    private:
+        // Fastest first, or round robin with rotate
+        std::vector<std::shared_ptr<detail::nameserver_state>> ranked() {
+            auto ret = servers;
+            if (options.rotate) {
+                std::rotate(ret.begin(), ret.begin() + (next_rotation++ % ret.size()), ret.end());
+                return ret;
+            }
+            std::stable_sort(ret.begin(), ret.end(), [] (const auto& a, const auto& b) {
+                return a->stats.srtt_ms < b->stats.srtt_ms;
+            });
+            for (size_t i = 1; i < ret.size(); i++) {
+                ret[i]->decay();
+            }
+            return ret;
+        }
+
+        // Detached, reports through race
+        static task<void> query_server(std::shared_ptr<detail::race_state> race,
+                                       std::shared_ptr<detail::nameserver_state> ns,
+                                       ::dns::packet_t req, double timeout_ms) {
+            const auto start = poll_loop_t::clock::now();
+            ns->stats.queries++;
+            try {
+                std::string resp = co_await detail::shared_client.query_raw(ns->address, std::move(req), timeout_ms, 1);
+                const ::dns::rcode_t rcode = ::dns::message_view(resp).flags().rcode;
+                if (detail::is_server_failure(rcode)) {
+                    ::dns::throw_rcode(rcode);
+                }
+                ns->on_answer(std::chrono::duration<double, std::milli>(poll_loop_t::clock::now() - start).count());
+                if (!race->answer) {
+                    race->answer = std::move(resp);
+                }
+            } catch (const c_api::timeout&) {
+                ns->stats.timeouts++;
+                ns->on_failure(timeout_ms);
+                race->error = std::current_exception();
+            } catch (...) {
+                ns->stats.failures++;
+                ns->on_failure(timeout_ms);
+                race->error = std::current_exception();
+            }
+            race->running--;
+            race->done.set();
+        }
+
+        resolver_options options;
+        resolver_stats stats_;
+        std::vector<std::shared_ptr<detail::nameserver_state>> servers;
+        size_t next_rotation = 0;
+    };
+}
@@ -0,0 +1,438 @@
+#pragma once
+#include "dns.h"
+#include "tcp_serve.h"
+#include <list>
+#include <unordered_map>
+
+namespace async::dns {
+    struct server_options {
+        size_t cache_capacity = 10000;
+        // TTLs of cached answers are clamped to this range
+        uint32_t min_ttl_s = 0;
+        uint32_t max_ttl_s = 86400;
+        // NXDOMAIN / NODATA answers are cached for their SOA minimum, at most this long
+        uint32_t max_negative_ttl_s = 3600;
+        // Answers served at least prefetch_min_hits times are refreshed in the background
+        // once less than prefetch_ratio of their TTL is left, 0 disables
+        double prefetch_ratio = 0.1;
+        size_t prefetch_min_hits = 3;
+        // Cache misses being forwarded at once, further UDP queries are dropped
+        size_t max_pending = 10000;
+        size_t max_tcp_connections = 1000;
+        double tcp_idle_timeout_ms = 10000;
+    };
+
+    struct server_stats {
+        size_t udp_queries = 0;
+        size_t tcp_queries = 0;
+        size_t hits = 0;
+        size_t misses = 0;
+        // Misses that waited for the same upstream query
+        size_t coalesced = 0;
+        size_t prefetches = 0;
+        // Answered with SERVFAIL
+        size_t upstream_failures = 0;
+        // UDP answers cut down to the question with TC set
+        size_t truncated = 0;
+        // Not a query or unparseable, dropped
+        size_t malformed = 0;
+        // Over max_pending
+        size_t dropped = 0;
+        size_t cache_size = 0;
+    };
+}
+
+namespace async::dns::detail {
+    // https://www.rfc-editor.org/rfc/rfc6891
+    inline constexpr uint16_t opt_rr_type = 41;
+
+    struct query_info {
+        uint16_t id;
+        ::dns::name_buffer name;
+        uint16_t qtype;
+        uint16_t qclass;
+        size_t question_end;
+        // Lowercase name, qtype and qclass
+        std::string key;
+        // From the EDNS OPT record, 512 without one
+        size_t udp_limit = 512;
+        ::dns::rcode_t error = ::dns::rcode_t::no_error;
+    };
+
+    // nullopt for responses and anything that can't be answered
+    inline std::optional<query_info> parse_query(std::string_view packet) {
+        try {
+            ::dns::message_view view(packet);
+            if (view.flags().qr != 0 || view.count(::dns::section_t::question) != 1) {
+                return std::nullopt;
+            }
+            query_info info;
+            info.id = view.id();
+            ::dns::question_view q;
+            (void) view.next_question(q);
+            info.question_end = view.offset();
+            view.name(q.name_offset, info.name);
+            info.qtype = q.qtype;
+            info.qclass = q.qclass;
+            info.key.reserve(info.name.size + 4);
+            for (char c : info.name.view()) { info.key.push_back(::dns::detail::ascii_lower(c)); }
+            for (uint16_t w : {q.qtype, q.qclass}) {
+                info.key.push_back(w >> 8);
+                info.key.push_back(w);
+            }
+            if (view.flags().opcode != ::dns::opcode_t::query) {
+                info.error = ::dns::rcode_t::not_implemented;
+            }
+            for (::dns::record_view rr; view.next_record(rr); ) {
+                if (rr.rtype == opt_rr_type) {
+                    info.udp_limit = std::clamp<size_t>(rr.rclass, 512, 4096);
+                }
+            }
+            return info;
+        } catch (const std::exception&) {
+            return std::nullopt;
+        }
+    }
+
+    // How long a response may be cached, nullopt if it must not be
+    inline std::optional<uint32_t> response_ttl(std::string_view packet, const server_options& options) {
+        ::dns::message_view view(packet);
+        const auto rcode = view.flags().rcode;
+        if (view.flags().tc || (rcode != ::dns::rcode_t::no_error && rcode != ::dns::rcode_t::name_error)) {
+            return std::nullopt;
+        }
+        std::optional<uint32_t> ttl;
+        std::optional<uint32_t> negative_ttl;
+        for (::dns::record_view rr; view.next_record(rr); ) {
+            if (rr.section == ::dns::section_t::answer) {
+                ttl = std::min(ttl.value_or(rr.ttl), rr.ttl);
+            } else if (rr.section == ::dns::section_t::authority && rr.rtype == 6) {
+                negative_ttl = ::dns::negative_ttl_from_SOA_RR(rr.ttl, rr.rdata);
+            }
+        }
+        if (rcode == ::dns::rcode_t::no_error && ttl) {
+            return std::clamp(*ttl, options.min_ttl_s, options.max_ttl_s);
+        }
+        // Negative answers without SOA aren't cached, RFC 2308 section 5
+        if (!negative_ttl) { return std::nullopt; }
+        return std::min(*negative_ttl, options.max_negative_ttl_s);
+    }
+
+    // Header and question only
+    inline void empty_response(const query_info& q, ::dns::rcode_t rcode, bool truncated, std::string& out) {
+        ::dns::flags_t flags = {
+            .qr = 1,
+            .opcode = ::dns::opcode_t::query,
+            .aa = 0,
+            .tc = truncated,
+            .rd = 1,
+            .ra = 1,
+            .z = 0,
+            .rcode = rcode,
+        };
+        ::dns::message_writer w(out, q.id, flags);
+        w.question(q.name.view(), q.qtype, q.qclass);
+    }
+
+    // Copies a cached response for this query: its id, RD bit and name case, TTLs reduced by age_s
+    inline void fit_response(std::string_view cached, std::string_view query, const query_info& q,
+                             uint32_t age_s, std::string& out) {
+        out.assign(cached);
+        out[0] = query[0];
+        out[1] = query[1];
+        out[2] = (out[2] & ~1) | (query[2] & 1);
+        // The first name in a packet is never compressed, so equal names have equal sizes
+        const std::string_view question = query.substr(12, q.question_end - 12);
+        if (out.size() >= q.question_end && ::dns::detail::iequal(std::string_view(out).substr(12, question.size()), question)) {
+            out.replace(12, question.size(), question);
+        }
+        if (age_s == 0) { return; }
+        ::dns::message_view view(out);
+        for (::dns::record_view rr; view.next_record(rr); ) {
+            if (rr.rtype == opt_rr_type) { continue; }
+            const uint32_t ttl = rr.ttl > age_s ? rr.ttl - age_s : 0;
+            char* p = out.data() + rr.rdata_offset - 6;
+            p[0] = ttl >> 24;
+            p[1] = ttl >> 16;
+            p[2] = ttl >> 8;
+            p[3] = ttl;
+        }
+    }
+
+    // Responses in wire format by query key, least recently used are evicted
+    class answer_cache {
+    public:
+        using clock = poll_loop_t::clock;
+        struct entry {
+            std::string key;
+            std::string packet;
+            clock::time_point stored;
+            clock::time_point expires;
+            size_t hits = 0;
+            bool refreshing = false;
+        };
+
+        // Expired entries are removed
+        entry* find(const std::string& key) {
+            auto iter = index.find(key);
+            if (iter == index.end()) { return nullptr; }
+            if (iter->second->expires <= clock::now()) {
+                entries.erase(iter->second);
+                index.erase(iter);
+                return nullptr;
+            }
+            entries.splice(entries.begin(), entries, iter->second);
+            return &entries.front();
+        }
+
+        void put(const std::string& key, std::string packet, uint32_t ttl_s) {
+            if (capacity == 0) { return; }
+            if (auto iter = index.find(key); iter != index.end()) {
+                entries.erase(iter->second);
+                index.erase(iter);
+            }
+            const auto now = clock::now();
+            entries.push_front({
+                .key = key,
+                .packet = std::move(packet),
+                .stored = now,
+                .expires = now + std::chrono::seconds(ttl_s),
+                .hits = 0,
+                .refreshing = false,
+            });
+            index.emplace(entries.front().key, entries.begin());
+            while (entries.size() > capacity) {
+                index.erase(entries.back().key);
+                entries.pop_back();
+            }
+        }
+
+        size_t size() const { return entries.size(); }
+        size_t capacity = 0;
+
+    private:
+        // Most recently used first
+        std::list<entry> entries;
+        std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+    };
+
+    struct inflight_response {
+        event done;
+        std::string packet;
+        std::exception_ptr error;
+    };
+}
+
+namespace async::dns {
+    // Caching forwarder. Serves UDP and TCP on the same port,
+    // answers from its cache and sends misses to the upstream nameservers.
+    class server {
+    public:
+        server(const std::vector<nameserver>& upstreams, server_options options = {}, resolver_options upstream_options = {})
+            : options(options), upstream(upstreams, upstream_options) {
+            cache.capacity = options.cache_capacity;
+        }
+        server(const server&) = delete;
+
+        // Returns after stop() once open connections and forwarded queries have finished
+        task<void> run(std::string_view ip, uint16_t port) {
+            c_api::fd udp = c_api::bind_udp(ip, port);
+            tcp::server listener = tcp::server::from_fd(c_api::bind_listen(ip, port));
+            udp_fd = udp;
+            tcp::serve_options tcp_options;
+            tcp_options.max_connections = options.max_tcp_connections;
+            tcp_options.idle_timeout_ms = options.tcp_idle_timeout_ms;
+            tcp_options.drain_timeout_ms = options.tcp_idle_timeout_ms;
+            auto tcp_done = tcp::serve(listener, [this] (transport::tcp_socket sock) {
+                return serve_tcp(std::move(sock));
+            }, tcp_options, tcp_control);
+            co_await serve_udp(udp);
+            co_await tcp_done;
+            while (pending != 0) {
+                idle.reset();
+                co_await idle.wait();
+            }
+            udp_fd = -1;
+        }
+
+        void stop() {
+            if (stopping) { return; }
+            stopping = true;
+            // Wakes the UDP loop even though the socket isn't connected
+            if (udp_fd != -1) { ::shutdown(udp_fd, SHUT_RD); }
+            tcp_control.stop();
+        }
+
+        server_stats stats() const {
+            server_stats ret = stats_;
+            ret.cache_size = cache.size();
+            return ret;
+        }
+        resolver_stats upstream_stats() const { return upstream.stats(); }
+
+    private:
+        task<void> serve_udp(int fd) {
+            std::string buf(msg_transport::udp_socket::max_incoming_packet_size, '\0');
+            std::string out;
+            sockaddr_in client;
+            while (!stopping) {
+                co_await poll_loop.wait_read(fd);
+                while (!stopping) {
+                    auto n_read = c_api::recvfrom(fd, buf.data(), buf.size(), client);
+                    if (!n_read) { break; }
+                    stats_.udp_queries++;
+                    const std::string_view query(buf.data(), *n_read);
+                    auto info = detail::parse_query(query);
+                    if (!info) {
+                        stats_.malformed++;
+                        continue;
+                    }
+                    if (answer_locally(query, *info, out)) {
+                        send_udp(fd, *info, out, client);
+                    } else if (pending >= options.max_pending) {
+                        stats_.dropped++;
+                    } else {
+                        spawn(forward_udp(fd, std::string(query), std::move(*info), client));
+                    }
+                }
+            }
+        }
+
+        // Detached
+        task<void> forward_udp(int fd, std::string query, detail::query_info info, sockaddr_in client) {
+            pending++;
+            std::string out;
+            co_await forward(query, info, out);
+            try {
+                send_udp(fd, info, out, client);
+            } catch (const std::exception&) {}
+            finished();
+        }
+
+        void send_udp(int fd, const detail::query_info& info, std::string& out, const sockaddr_in& client) {
+            if (out.size() > info.udp_limit) {
+                stats_.truncated++;
+                detail::empty_response(info, ::dns::message_view(out).flags().rcode, true, out);
+            }
+            // Dropped if the socket buffer is full, the client retries
+            (void) c_api::sendto(fd, out, client);
+        }
+
+        // Messages are prefixed with their length, RFC 1035 section 4.2.2
+        task<void> serve_tcp(transport::tcp_socket sock) {
+            stream conn {std::move(sock)};
+            std::string len, query, out;
+            while (!stopping) {
+                len.clear();
+                co_await conn.read_n(2, len);
+                query.clear();
+                co_await conn.read_n(static_cast<uint8_t>(len[0]) << 8 | static_cast<uint8_t>(len[1]), query);
+                stats_.tcp_queries++;
+                auto info = detail::parse_query(query);
+                if (!info) {
+                    stats_.malformed++;
+                    co_return;
+                }
+                if (!answer_locally(query, *info, out)) {
+                    co_await forward(query, *info, out);
+                }
+                len[0] = out.size() >> 8;
+                len[1] = out.size();
+                co_await conn.write(len);
+                co_await conn.write(out);
+                co_await conn.flush();
+            }
+        }
+
+        // Errors and cache hits, false if the query has to go upstream
+        bool answer_locally(std::string_view query, const detail::query_info& info, std::string& out) {
+            if (info.error != ::dns::rcode_t::no_error) {
+                detail::empty_response(info, info.error, false, out);
+                return true;
+            }
+            auto* entry = cache.find(info.key);
+            if (!entry) { return false; }
+            stats_.hits++;
+            entry->hits++;
+            const auto now = poll_loop_t::clock::now();
+            const uint32_t age_s = std::chrono::duration_cast<std::chrono::seconds>(now - entry->stored).count();
+            detail::fit_response(entry->packet, query, info, age_s, out);
+            if (options.prefetch_ratio != 0 && !entry->refreshing && entry->hits >= options.prefetch_min_hits
+                && entry->expires - now < (entry->expires - entry->stored) * options.prefetch_ratio) {
+                entry->refreshing = true;
+                stats_.prefetches++;
+                spawn(prefetch(std::string(query), info.key));
+            }
+            return true;
+        }
+
+        // Fills out with the upstream answer or SERVFAIL
+        task<void> forward(std::string_view query, const detail::query_info& info, std::string& out) {
+            stats_.misses++;
+            try {
+                const std::string packet = co_await resolve(query, info.key);
+                detail::fit_response(packet, query, info, 0, out);
+            } catch (const std::exception&) {
+                stats_.upstream_failures++;
+                detail::empty_response(info, ::dns::rcode_t::server_failure, false, out);
+            }
+        }
+
+        // Detached
+        task<void> prefetch(std::string query, std::string key) {
+            pending++;
+            try {
+                (void) co_await resolve(query, key);
+            } catch (const std::exception&) {
+                // Try again on a later hit
+                if (auto* entry = cache.find(key)) { entry->refreshing = false; }
+            }
+            finished();
+        }
+
+        // Queries upstream and caches the response, joins an identical query in flight
+        task<std::string> resolve(std::string_view query, const std::string& key) {
+            if (auto iter = inflight.find(key); iter != inflight.end()) {
+                auto flight = iter->second;
+                stats_.coalesced++;
+                co_await flight->done.wait();
+                if (flight->error) { std::rethrow_exception(flight->error); }
+                co_return flight->packet;
+            }
+            auto flight = std::make_shared<detail::inflight_response>();
+            inflight.emplace(key, flight);
+            try {
+                ::dns::packet_t req = ::dns::packet_t::from_string(query);
+                req.flags.rd = 1;
+                // As sent, re-encoding would break compression pointers inside rdata
+                flight->packet = co_await upstream.query_raw(std::move(req));
+                if (auto ttl = detail::response_ttl(flight->packet, options)) {
+                    cache.put(key, flight->packet, *ttl);
+                }
+            } catch (...) {
+                flight->error = std::current_exception();
+            }
+            inflight.erase(key);
+            flight->done.set();
+            if (flight->error) { std::rethrow_exception(flight->error); }
+            co_return flight->packet;
+        }
+
+        void finished() {
+            pending--;
+            if (pending == 0) { idle.set(); }
+        }
+
+        server_options options;
+        nameserver_set upstream;
+        detail::answer_cache cache;
+        std::unordered_map<std::string, std::shared_ptr<detail::inflight_response>> inflight;
+        server_stats stats_;
+        bool stopping = false;
+        int udp_fd = -1;
+        tcp::serve_control tcp_control;
+        // Detached forward_udp() and prefetch() calls, run() waits for them
+        size_t pending = 0;
+        event idle;
+    };
+}
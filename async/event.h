@@ -0,0 +1,42 @@
+#pragma once
+#include "coro.h"
+#include "poll_loop.h"
+#include "posix_wrappers.h"
+
+namespace async {
+    // Manual-reset event, wakes all waiters when set.
+    // Backed by an eventfd so waiting goes through the poll loop.
+    class event {
+    public:
+        event() : fd_handle(c_api::eventfd()) {}
+
+        void set() {
+            if (!is_set_flag) {
+                is_set_flag = true;
+                c_api::eventfd_write(fd_handle, 1);
+            }
+        }
+        void reset() {
+            (void) c_api::eventfd_read(fd_handle);
+            is_set_flag = false;
+        }
+        bool is_set() const { return is_set_flag; }
+
+        task<void> wait() {
+            if (!is_set_flag) {
+                co_await poll_loop.wait_read(fd_handle);
+            }
+        }
+        // Returns false on timeout
+        task<bool> wait_for(double ms) {
+            if (is_set_flag) { co_return true; }
+            co_return co_await poll_loop.wait_read_for(fd_handle, ms);
+        }
+
+        const c_api::fd& fd() const { return fd_handle; }
+
+    private:
+        c_api::fd fd_handle;
+        bool is_set_flag = false;
+    };
+}
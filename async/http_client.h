@@ -0,0 +1,563 @@
+#pragma once
+#include "tcp.h"
+#include "tls.h"
+#include <fmt.h>
+#include <http.h>
+#include <poll.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+namespace async::detail {
+    struct uri_view {
+        std::optional<std::string_view> proto;
+        std::optional<std::string_view> host;
+        std::optional<uint16_t> port;
+        std::optional<std::string_view> path;
+    };
+
+    inline auto parse_host_port(std::string_view host_port) {
+        std::pair<std::string_view, std::optional<std::string_view>> ret;
+        const auto i_colon = host_port.find(':');
+        if (i_colon != host_port.npos) {
+            ret.first = host_port.substr(0, i_colon);
+            ret.second = host_port.substr(i_colon + 1);
+        } else {
+            ret.first = host_port;
+        }
+        return ret;
+    }
+
+    inline uri_view parse_uri(std::string_view uri) {
+        const auto i_proto_end = uri.find("://");
+        if (i_proto_end == uri.npos) {
+            return {
+                .proto = std::nullopt,
+                .host = std::nullopt,
+                .port = std::nullopt,
+                .path = uri,
+            };
+        }
+        const auto proto = uri.substr(0, i_proto_end);
+        // handle path with no proto but :// in path
+        for (auto c : proto) {
+            if (!isalnum(c)) {
+                return {
+                    .proto = std::nullopt,
+                    .host = std::nullopt,
+                    .port = std::nullopt,
+                    .path = uri,
+                };
+            }
+        }
+        const auto i_host_start = i_proto_end + 3;
+        auto i_host_end = uri.find("/", i_host_start);
+        if (i_host_end == uri.npos) {
+            i_host_end = uri.size();
+        }
+        const auto host_port = uri.substr(i_host_start, i_host_end - i_host_start);
+        const auto [host, opt_port] = parse_host_port(host_port);
+        const auto path = uri.substr(i_host_end);
+        std::optional<uint16_t> opt_port_num;
+        if (opt_port) {
+            if (opt_port->size() > 5) {
+                throw ex::runtime("invalid uri port");
+            }
+            opt_port_num = std::stoi(std::string(*opt_port));
+        }
+        return {
+            .proto = proto,
+            .host = host,
+            .port = opt_port_num,
+            .path = !path.empty() ? std::optional{path} : std::nullopt,
+        };
+    }
+}
+
+namespace async::http {
+    struct client_options {
+        // Idle connections kept per origin
+        size_t max_idle_per_origin = 4;
+        // Idle connections older than this are closed instead of reused
+        double idle_timeout_ms = 30000;
+        // Requests get_many() sends on a connection ahead of the responses, 1 disables pipelining
+        size_t pipeline_depth = 8;
+        size_t max_redirects = 16;
+    };
+
+    struct client_stats {
+        size_t requests = 0;
+        size_t connections_opened = 0;
+        size_t connections_reused = 0;
+        // Requests sent while earlier ones on the connection were unanswered
+        size_t pipelined = 0;
+        size_t redirects = 0;
+        // Requests sent again because a reused connection turned out to be closed
+        size_t retries = 0;
+    };
+
+    struct response {
+        unsigned status = 0;
+        std::string reason;
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::string body;
+        // Final URL after redirects
+        std::string url;
+
+        // Empty if missing
+        std::string_view get(std::string_view name) const {
+            for (const auto& [k, v] : headers) {
+                if (::http::iequal(k, name)) { return v; }
+            }
+            return {};
+        }
+    };
+
+    // Receives 2xx response bodies part by part as they arrive instead of response::body.
+    // Bodies of other responses are small and still buffered.
+    struct body_sink {
+        std::function<task<void>(std::string_view)> write;
+        // Content-Length bodies on plain TCP connections are spliced from the socket straight into
+        // this fd, which must be a regular file not opened with O_APPEND.
+        // -1 always uses write
+        int splice_fd = -1;
+        // Body bytes delivered either way
+        uint64_t written = 0;
+        // Of those, bytes that went through splice_fd
+        uint64_t spliced = 0;
+    };
+}
+
+namespace async::http::detail {
+    using tcp_stream = stream<transport::tcp_socket>;
+    using tls_stream = stream<transport::tls_client<transport::tcp_socket>>;
+
+    struct origin {
+        bool tls;
+        std::string host;
+        uint16_t port;
+        // "https://host:port", the pool key
+        std::string key;
+    };
+
+    inline origin origin_of(const async::detail::uri_view& uri) {
+        if (uri.proto != "http" && uri.proto != "https") {
+            throw ex::runtime("http client only supports http and https urls");
+        }
+        const bool tls = uri.proto == "https";
+        const std::string host(uri.host.value());
+        const uint16_t port = uri.port.value_or(tls ? 443 : 80);
+        std::string key = fmt_raw(*uri.proto, "://", host, ":", port);
+        std::ranges::transform(key, key.begin(), ::dns::detail::ascii_lower);
+        return {tls, host, port, std::move(key)};
+    }
+
+    // A request that failed before any of its response arrived, on a connection that had
+    // answered before. The server most likely closed it while idle, so the request is resent.
+    struct stale_connection : std::exception {
+        const char* what() const noexcept override { return "http connection closed by server"; }
+    };
+
+    struct connection {
+        std::variant<tcp_stream, tls_stream> stream;
+        ::http::parser parser {::http::message_kind::response};
+        // Read but not parsed yet, may hold the start of the next pipelined response
+        std::string input;
+        size_t input_pos = 0;
+        size_t responses = 0;
+        // Whether the last response allows another request
+        bool keep_alive = true;
+        poll_loop_t::clock::time_point idle_since;
+
+        int fd() const {
+            if (auto* tcp = std::get_if<tcp_stream>(&stream)) {
+                return tcp->transport.native_handle();
+            }
+            return std::get<tls_stream>(stream).transport.transport.native_handle();
+        }
+        // The server closed it or sent something unasked while it was idle
+        bool readable_while_idle() const {
+            pollfd p {.fd = fd(), .events = POLLIN | POLLRDHUP, .revents = 0};
+            return ::poll(&p, 1, 0) != 0 || input_pos != input.size();
+        }
+        task<void> write(std::string_view data) {
+            bool failed = false;
+            try {
+                if (auto* tcp = std::get_if<tcp_stream>(&stream)) {
+                    co_await tcp->write(data);
+                } else {
+                    co_await std::get<tls_stream>(stream).write(data);
+                }
+            } catch (const std::exception&) {
+                if (responses == 0) { throw; }
+                failed = true;
+            }
+            if (failed) { throw stale_connection(); }
+        }
+        // Reads are capped so that streamed body parts stay small however much the socket holds
+        static constexpr size_t max_read = 256 * 1024;
+
+        task<size_t> read_some(std::string& out) {
+            if (auto* tcp = std::get_if<tcp_stream>(&stream)) {
+                co_await tcp->transport.wait_read();
+                const size_t n = std::clamp<size_t>(tcp->transport.available_bytes(), 1, max_read);
+                out.resize(out.size() + n);
+                const size_t n_read = tcp->transport.read(out.data() + out.size() - n, n);
+                out.resize(out.size() - n + n_read);
+                co_return n_read;
+            }
+            co_return co_await std::get<tls_stream>(stream).read_some(out);
+        }
+    };
+
+    inline std::string format_request(std::string_view method, const origin& o, std::string_view path,
+                                      std::string_view body) {
+        const bool default_port = o.port == (o.tls ? 443 : 80);
+        std::string ret = fmt_raw(method, " ", path.empty() ? "/" : path, " HTTP/1.1\r\nHost: ", o.host);
+        if (!default_port) {
+            ret += fmt_raw(":", o.port);
+        }
+        ret += "\r\n";
+        if (!body.empty() || method == "POST" || method == "PUT") {
+            ret += fmt_raw("Content-Length: ", body.size(), "\r\n");
+        }
+        ret += "\r\n";
+        ret += body;
+        return ret;
+    }
+
+    inline std::pair<c_api::fd, c_api::fd> new_splice_pipe() {
+        auto ret = c_api::pipe();
+        // Fewer round trips, best effort
+        ::fcntl(ret.second, F_SETPIPE_SZ, 1024 * 1024);
+        return ret;
+    }
+    // Pipe buffers for splicing, reused by the thread's transfers.
+    // Empty whenever a transfer waits, so transfers can share it.
+    inline std::pair<c_api::fd, c_api::fd>& splice_pipe() {
+        thread_local std::pair<c_api::fd, c_api::fd> pipe = new_splice_pipe();
+        return pipe;
+    }
+
+    // Moves the next n body bytes from the socket into sink.splice_fd through a pipe
+    inline task<void> splice_body(tcp_stream& sock, body_sink& sink, uint64_t n) {
+        auto& pipe = splice_pipe();
+        try {
+            while (n != 0) {
+                const size_t moved = c_api::splice(sock.transport.native_handle(), pipe.second,
+                                                   std::min<uint64_t>(n, 1024 * 1024));
+                if (moved == 0) {
+                    co_await sock.transport.wait_read();
+                    continue;
+                }
+                // A regular file takes all of it without blocking
+                for (size_t left = moved; left != 0;) {
+                    left -= c_api::splice(pipe.first, sink.splice_fd, left);
+                }
+                n -= moved;
+                sink.written += moved;
+                sink.spliced += moved;
+            }
+        } catch (...) {
+            // Bytes may be left in the pipe, the next transfer gets a fresh one
+            pipe = new_splice_pipe();
+            throw;
+        }
+    }
+
+    // Reads the next response on the connection. Interim 1xx responses are skipped.
+    // With a sink, the body of a 2xx response goes there instead of response::body.
+    inline task<response> read_response(connection& conn, bool head, body_sink* sink = nullptr) {
+        response ret;
+        if (head) { conn.parser.expect_no_body(); }
+        ::http::event ev;
+        bool started = false;
+        bool streaming = false;
+        while (true) {
+            conn.input_pos += conn.parser.next(std::string_view(conn.input).substr(conn.input_pos), ev);
+            switch (ev.type) {
+            case ::http::event::need_more: {
+                conn.input.clear();
+                conn.input_pos = 0;
+                bool eof = false;
+                try {
+                    co_await conn.read_some(conn.input);
+                } catch (const c_api::eof&) {
+                    eof = true;
+                } catch (const std::exception&) {
+                    if (!started && conn.responses != 0) { throw stale_connection(); }
+                    throw;
+                }
+                if (eof) {
+                    if (!started && conn.responses != 0) { throw stale_connection(); }
+                    if (!conn.parser.eof()) {
+                        throw ex::runtime("http server closed the connection before responding");
+                    }
+                    conn.responses++;
+                    conn.keep_alive = false;
+                    co_return ret;
+                }
+                break;
+            }
+            case ::http::event::start_line:
+                started = true;
+                ret.status = ev.status;
+                ret.reason = ev.reason;
+                ret.headers.clear();
+                break;
+            case ::http::event::header:
+                ret.headers.emplace_back(ev.name, ev.value);
+                break;
+            case ::http::event::headers_done: {
+                streaming = sink && ret.status / 100 == 2;
+                auto* tcp = std::get_if<tcp_stream>(&conn.stream);
+                const auto length = conn.parser.content_length();
+                if (!streaming || !tcp || sink->splice_fd == -1 || head || !length) { break; }
+                // What was read with the headers goes through write, the rest is spliced.
+                // The parser is bypassed and replaced for the next response.
+                const uint64_t buffered = std::min<uint64_t>(*length, conn.input.size() - conn.input_pos);
+                if (buffered != 0) {
+                    co_await sink->write(std::string_view(conn.input).substr(conn.input_pos, buffered));
+                    sink->written += buffered;
+                    conn.input_pos += buffered;
+                }
+                co_await splice_body(*tcp, *sink, *length - buffered);
+                conn.keep_alive = conn.parser.keep_alive();
+                conn.parser = ::http::parser(::http::message_kind::response);
+                conn.responses++;
+                co_return ret;
+            }
+            case ::http::event::body:
+                if (streaming) {
+                    co_await sink->write(ev.data);
+                    sink->written += ev.data.size();
+                } else {
+                    ret.body.append(ev.data);
+                }
+                break;
+            case ::http::event::message_done:
+                if (ret.status / 100 == 1 && ret.status != 101) {
+                    if (head) { conn.parser.expect_no_body(); }
+                    break;
+                }
+                conn.responses++;
+                conn.keep_alive = conn.parser.keep_alive();
+                co_return ret;
+            case ::http::event::trailer:
+                break;
+            }
+        }
+    }
+
+    // Location relative to the url it redirects from
+    inline std::string resolve_location(std::string_view base, std::string_view location) {
+        const auto uri = async::detail::parse_uri(base);
+        const std::string origin = fmt_raw(*uri.proto, "://", *uri.host, uri.port ? fmt_raw(":", *uri.port) : "");
+        if (location.find("://") != std::string_view::npos) {
+            return std::string(location);
+        } else if (location.starts_with("//")) {
+            return fmt_raw(*uri.proto, ":", location);
+        } else if (location.starts_with('/')) {
+            return origin + std::string(location);
+        }
+        std::string_view dir = uri.path.value_or("/");
+        dir = dir.substr(0, dir.rfind('/') + 1);
+        return fmt_raw(origin, dir, location);
+    }
+
+    inline bool is_redirect(unsigned status) {
+        return status == 301 || status == 302 || status == 303 || status == 307 || status == 308;
+    }
+
+    // Safe to send twice, RFC 9110 section 9.2.2
+    inline bool is_idempotent(std::string_view method) {
+        return method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "TRACE"
+            || method == "PUT" || method == "DELETE";
+    }
+}
+
+namespace async::http {
+    // HTTP/1.1 client keeping persistent connections per origin (scheme, host, port).
+    // Connections return to the pool after a response that allows keep-alive.
+    class client {
+    public:
+        explicit client(client_options options = {}) : options(options) {}
+        client(const client&) = delete;
+
+        // Follows redirects, on the pooled connection when they stay on the same origin.
+        // With a sink, the final body is streamed to it if the status is 2xx.
+        task<response> get(std::string_view url, body_sink* sink = nullptr) {
+            std::string current(url);
+            for (size_t redirects = 0; ; redirects++) {
+                response resp = co_await request("GET", current, {}, sink);
+                const std::string_view location = resp.get("Location");
+                if (!detail::is_redirect(resp.status) || location.empty()) {
+                    resp.url = std::move(current);
+                    co_return resp;
+                }
+                if (redirects == options.max_redirects) {
+                    throw ex::runtime("too many http redirects");
+                }
+                stats_.redirects++;
+                current = detail::resolve_location(current, location);
+            }
+        }
+
+        // One request without following redirects. Only idempotent methods are resent
+        // when a pooled connection turns out closed, others throw.
+        task<response> request(std::string_view method, std::string_view url, std::string_view body = {},
+                               body_sink* sink = nullptr) {
+            const auto uri = async::detail::parse_uri(url);
+            const detail::origin o = detail::origin_of(uri);
+            const std::string wire = detail::format_request(method, o, uri.path.value_or("/"), body);
+            const bool head = method == "HEAD";
+            const bool idempotent = detail::is_idempotent(method);
+            stats_.requests++;
+            while (true) {
+                auto conn = co_await acquire(o);
+                std::optional<response> resp;
+                try {
+                    co_await conn->write(wire);
+                    resp = co_await detail::read_response(*conn, head, sink);
+                } catch (const detail::stale_connection&) {
+                    // The server may have acted on it before closing
+                    if (!idempotent) { throw; }
+                    stats_.retries++;
+                    continue;
+                }
+                resp->url = std::string(url);
+                release(o, std::move(conn));
+                co_return std::move(*resp);
+            }
+        }
+
+        // GETs without following redirects, responses in the order of urls.
+        // Requests to the same origin are pipelined on one connection, up to pipeline_depth ahead,
+        // and different origins are fetched concurrently.
+        task<std::vector<response>> get_many(std::span<const std::string_view> urls) {
+            std::vector<response> ret(urls.size());
+            std::vector<std::pair<detail::origin, std::vector<size_t>>> origins;
+            for (size_t i = 0; i < urls.size(); i++) {
+                detail::origin o = detail::origin_of(async::detail::parse_uri(urls[i]));
+                auto iter = std::ranges::find(origins, o.key, [] (const auto& p) { return p.first.key; });
+                if (iter == origins.end()) {
+                    origins.emplace_back(std::move(o), std::vector<size_t>{});
+                    iter = origins.end() - 1;
+                }
+                iter->second.push_back(i);
+            }
+            std::vector<std::exception_ptr> errors(origins.size());
+            std::vector<task<void>> workers;
+            for (size_t i = 0; i < origins.size(); i++) {
+                workers.push_back(pipeline(origins[i].first, origins[i].second, urls, ret, errors[i]));
+            }
+            for (auto& worker : workers) {
+                co_await worker;
+            }
+            for (const auto& error : errors) {
+                if (error) { std::rethrow_exception(error); }
+            }
+            co_return ret;
+        }
+
+        const client_stats& stats() const { return stats_; }
+        // Idle connections in the pool
+        size_t idle_count() const {
+            size_t ret = 0;
+            for (const auto& [key, conns] : idle) { ret += conns.size(); }
+            return ret;
+        }
+        void close_idle() { idle.clear(); }
+
+    private:
+        task<std::unique_ptr<detail::connection>> acquire(const detail::origin& o) {
+            const auto now = poll_loop_t::clock::now();
+            const auto max_idle = std::chrono::duration_cast<poll_loop_t::clock::duration>(
+                std::chrono::duration<double, std::milli>(options.idle_timeout_ms));
+            if (auto iter = idle.find(o.key); iter != idle.end()) {
+                auto& conns = iter->second;
+                while (!conns.empty()) {
+                    auto conn = std::move(conns.back());
+                    conns.pop_back();
+                    if (now - conn->idle_since < max_idle && !conn->readable_while_idle()) {
+                        stats_.connections_reused++;
+                        co_return conn;
+                    }
+                }
+            }
+            stats_.connections_opened++;
+            if (o.tls) {
+                detail::tls_stream s = co_await tls::connect(o.host, o.port);
+                co_return std::make_unique<detail::connection>(std::move(s));
+            }
+            detail::tcp_stream s = co_await tcp::connect(o.host, o.port);
+            co_return std::make_unique<detail::connection>(std::move(s));
+        }
+
+        void release(const detail::origin& o, std::unique_ptr<detail::connection> conn) {
+            if (!conn->keep_alive || conn->input_pos != conn->input.size()) { return; }
+            auto& conns = idle[o.key];
+            if (conns.size() >= options.max_idle_per_origin) { return; }
+            conn->idle_since = poll_loop_t::clock::now();
+            conns.push_back(std::move(conn));
+        }
+
+        // Doesn't throw, reports through error
+        task<void> pipeline(const detail::origin& o, const std::vector<size_t>& indexes,
+                            std::span<const std::string_view> urls, std::vector<response>& out,
+                            std::exception_ptr& error) {
+            try {
+                size_t answered = 0;
+                while (answered < indexes.size()) {
+                    auto conn = co_await acquire(o);
+                    size_t sent = answered;
+                    bool reconnect = false;
+                    while (answered < indexes.size() && !reconnect) {
+                        // Keep up to pipeline_depth requests outstanding
+                        std::string batch;
+                        while (sent < indexes.size() && sent - answered < std::max<size_t>(options.pipeline_depth, 1)) {
+                            if (sent != answered) { stats_.pipelined++; }
+                            const auto uri = async::detail::parse_uri(urls[indexes[sent]]);
+                            batch += detail::format_request("GET", o, uri.path.value_or("/"), {});
+                            stats_.requests++;
+                            sent++;
+                        }
+                        std::optional<response> resp;
+                        try {
+                            if (!batch.empty()) { co_await conn->write(batch); }
+                            resp = co_await detail::read_response(*conn, false);
+                        } catch (const detail::stale_connection&) {
+                            stats_.retries += sent - answered;
+                            reconnect = true;
+                            continue;
+                        }
+                        resp->url = std::string(urls[indexes[answered]]);
+                        out[indexes[answered]] = std::move(*resp);
+                        answered++;
+                        // The rest has to be sent again on a new connection
+                        reconnect = !conn->keep_alive && answered < indexes.size();
+                        if (reconnect && sent > answered) { stats_.retries += sent - answered; }
+                    }
+                    if (!reconnect) {
+                        release(o, std::move(conn));
+                    }
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+
+        client_options options;
+        client_stats stats_;
+        std::unordered_map<std::string, std::vector<std::unique_ptr<detail::connection>>> idle;
+    };
+}
+
+namespace async::http::detail {
+    // Used by slurp()
+    inline thread_local client shared_client;
+}
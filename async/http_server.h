@@ -0,0 +1,313 @@
+#pragma once
+#include "http_client.h"
+#include "tcp_serve.h"
+#include <functional>
+#include <unordered_set>
+
+namespace async::http {
+    struct request {
+        std::string method;
+        std::string target;
+        std::string version;
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::string body;
+
+        // Empty if missing
+        std::string_view get(std::string_view name) const {
+            for (const auto& [k, v] : headers) {
+                if (::http::iequal(k, name)) { return v; }
+            }
+            return {};
+        }
+        // Target without the query string
+        std::string_view path() const { return std::string_view(target).substr(0, target.find('?')); }
+        // After '?', empty if there is none
+        std::string_view query() const {
+            const auto i = target.find('?');
+            return i == target.npos ? std::string_view() : std::string_view(target).substr(i + 1);
+        }
+    };
+
+    struct server_options {
+        // Request line and headers together, or trailers, as received.
+        // Larger ones are answered with 431
+        size_t max_header_bytes = 16 * 1024;
+        // Larger bodies are answered with 413
+        size_t max_body_bytes = 1024 * 1024;
+        // The connection is closed after this many requests, 0 disables
+        size_t max_requests_per_connection = 1000;
+        // Before closing, input is read and dropped for up to this long so the
+        // last response isn't lost to a reset caused by unread pipelined requests
+        double linger_ms = 1000;
+        // Accepting and connection timeouts
+        tcp::serve_options serve;
+    };
+
+    struct server_stats {
+        size_t requests = 0;
+        // Requests after the first on their connection
+        size_t reused = 0;
+        // Answered 400, 413 or 431 by the server without reaching a handler
+        size_t rejected = 0;
+        // No route, answered 404 or 405
+        size_t not_found = 0;
+        // Handler threw, answered 500
+        size_t handler_errors = 0;
+    };
+
+    using handler_t = std::function<task<response>(const request&)>;
+}
+
+namespace async::http::detail {
+    inline std::string_view reason_phrase(unsigned status) {
+        switch (status) {
+        case 100: return "Continue";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Content Too Large";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+        }
+    }
+
+    inline response status_response(unsigned status) {
+        response ret;
+        ret.status = status;
+        ret.body = fmt_raw(status, " ", reason_phrase(status), "\n");
+        return ret;
+    }
+
+    // Removes fd from the idle set when the read it guards finishes
+    struct idle_mark {
+        std::unordered_set<int>* idle;
+        int fd;
+        ~idle_mark() { if (idle) { idle->erase(fd); } }
+    };
+
+    // Writes the head and the body with one gathering write, without copying the body
+    inline task<void> send_response(transport::tcp_socket& sock, const response& resp, bool head, bool close) {
+        std::string out = fmt_raw("HTTP/1.1 ", resp.status, " ",
+                                  resp.reason.empty() ? reason_phrase(resp.status) : std::string_view(resp.reason), "\r\n");
+        for (const auto& [k, v] : resp.headers) {
+            if (::http::iequal(k, "Content-Length") || ::http::iequal(k, "Connection")) { continue; }
+            out += fmt_raw(k, ": ", v, "\r\n");
+        }
+        out += fmt_raw("Content-Length: ", resp.body.size(), "\r\n");
+        if (close) {
+            out += "Connection: close\r\n";
+        }
+        out += "\r\n";
+        std::array<iovec, 2> parts {{
+            {out.data(), out.size()},
+            {const_cast<char*>(resp.body.data()), head ? 0 : resp.body.size()},
+        }};
+        std::span<iovec> left(parts);
+        while (true) {
+            size_t n = sock.writev(left);
+            while (!left.empty() && n >= left[0].iov_len) {
+                n -= left[0].iov_len;
+                left = left.subspan(1);
+            }
+            if (left.empty()) { break; }
+            left[0].iov_base = static_cast<char*>(left[0].iov_base) + n;
+            left[0].iov_len -= n;
+            co_await sock.wait_write();
+        }
+    }
+}
+
+namespace async::http {
+    // HTTP/1.1 server on tcp::serve. Connections are kept alive between requests,
+    // requests are parsed incrementally (pipelined ones included) and handed to the
+    // handler routed by method and exact path.
+    class server {
+    public:
+        explicit server(server_options options = {}) : options(options) {}
+        server(const server&) = delete;
+
+        // An empty method matches any, HEAD requests use GET routes
+        void route(std::string_view method, std::string_view path, handler_t handler) {
+            routes[std::string(path)].emplace_back(std::string(method), std::move(handler));
+        }
+        // Handles requests no route matches instead of answering 404
+        void fallback(handler_t handler) { fallback_handler = std::move(handler); }
+
+        // Returns after stop() once all connections have finished
+        task<void> serve(tcp::server& listener) {
+            co_await tcp::serve(listener, [this] (transport::tcp_socket sock) {
+                return serve_connection(std::move(sock));
+            }, options.serve, control);
+        }
+        // Stops accepting, closes idle connections and makes busy ones close after their current request
+        void stop() {
+            control.stop();
+            for (int fd : idle) {
+                ::shutdown(fd, SHUT_RD);
+            }
+        }
+
+        const server_stats& stats() const { return stats_; }
+        const tcp::serve_stats& connection_stats() const { return control.stats(); }
+
+    private:
+        const handler_t* find(const request& req) {
+            auto iter = routes.find(std::string(req.path()));
+            if (iter == routes.end()) { return nullptr; }
+            for (const auto& [method, handler] : iter->second) {
+                if (method.empty() || method == req.method || (req.method == "HEAD" && method == "GET")) {
+                    return &handler;
+                }
+            }
+            return nullptr;
+        }
+
+        task<response> dispatch(const request& req) {
+            const handler_t* handler = find(req);
+            if (!handler && fallback_handler) {
+                handler = &fallback_handler;
+            }
+            if (!handler) {
+                stats_.not_found++;
+                co_return detail::status_response(routes.contains(std::string(req.path())) ? 405 : 404);
+            }
+            std::optional<response> ret;
+            try {
+                ret = co_await (*handler)(req);
+            } catch (const std::exception&) {
+                stats_.handler_errors++;
+            }
+            if (!ret) {
+                ret = detail::status_response(500);
+            }
+            co_return std::move(*ret);
+        }
+
+        // Half-closes and drops input until the client closes too
+        task<void> linger(stream<transport::tcp_socket>& conn) {
+            ::shutdown(conn.transport.native_handle(), SHUT_WR);
+            conn.transport.set_timeout(options.linger_ms);
+            std::string discard;
+            try {
+                while (true) {
+                    discard.clear();
+                    co_await conn.read_some(discard);
+                }
+            } catch (const c_api::eof&) {
+            } catch (const c_api::timeout&) {
+            }
+        }
+
+        // Answers and closes, the rest of the connection can't be parsed reliably
+        task<void> reject(stream<transport::tcp_socket>& conn, unsigned status) {
+            stats_.rejected++;
+            co_await detail::send_response(conn.transport, detail::status_response(status), false, true);
+            co_await linger(conn);
+        }
+
+        task<void> serve_connection(transport::tcp_socket sock) {
+            const int fd = sock.native_handle();
+            c_api::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+            stream conn {std::move(sock)};
+            ::http::parser parser(::http::message_kind::request, options.max_header_bytes);
+            ::http::event ev;
+            request req;
+            std::string input;
+            size_t input_pos = 0;
+            size_t served = 0;
+            // Between requests, may be closed by stop()
+            bool between = true;
+            while (true) {
+                unsigned reject_status = 0;
+                try {
+                    input_pos += parser.next(std::string_view(input).substr(input_pos), ev);
+                } catch (const ::http::header_overflow&) {
+                    reject_status = 431;
+                } catch (const std::runtime_error&) {
+                    reject_status = 400;
+                }
+                if (reject_status) {
+                    co_await reject(conn, reject_status);
+                    co_return;
+                }
+                switch (ev.type) {
+                case ::http::event::need_more:
+                    if (between && control.is_stopping()) { co_return; }
+                    input.clear();
+                    input_pos = 0;
+                    if (between) { idle.insert(fd); }
+                    {
+                        detail::idle_mark mark {between ? &idle : nullptr, fd};
+                        co_await conn.read_some(input);
+                    }
+                    break;
+                case ::http::event::start_line:
+                    between = false;
+                    req = {};
+                    req.method = ev.method;
+                    req.target = ev.target;
+                    req.version = ev.version;
+                    break;
+                case ::http::event::header:
+                case ::http::event::trailer:
+                    req.headers.emplace_back(ev.name, ev.value);
+                    break;
+                case ::http::event::headers_done:
+                    if (parser.content_length().value_or(0) > options.max_body_bytes) {
+                        reject_status = 413;
+                    } else if (::http::iequal(req.get("Expect"), "100-continue")) {
+                        co_await conn.write("HTTP/1.1 100 Continue\r\n\r\n");
+                    }
+                    break;
+                case ::http::event::body:
+                    if (req.body.size() + ev.data.size() > options.max_body_bytes) {
+                        reject_status = 413;
+                    }
+                    req.body.append(ev.data);
+                    break;
+                case ::http::event::message_done: {
+                    stats_.requests++;
+                    if (served++ != 0) { stats_.reused++; }
+                    const bool keep_alive = parser.keep_alive() && !control.is_stopping() &&
+                        (options.max_requests_per_connection == 0 || served < options.max_requests_per_connection);
+                    const response resp = co_await dispatch(req);
+                    co_await detail::send_response(conn.transport, resp, req.method == "HEAD", !keep_alive);
+                    if (!keep_alive) {
+                        co_await linger(conn);
+                        co_return;
+                    }
+                    between = true;
+                    break;
+                }
+                }
+                if (reject_status) {
+                    co_await reject(conn, reject_status);
+                    co_return;
+                }
+            }
+        }
+
+        server_options options;
+        server_stats stats_;
+        tcp::serve_control control;
+        std::unordered_map<std::string, std::vector<std::pair<std::string, handler_t>>> routes;
+        handler_t fallback_handler;
+        // Connections waiting for their next request
+        std::unordered_set<int> idle;
+    };
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <chrono>
 #include <coroutine>
 #include <cstring>
 #include <vector>
@@ -7,19 +8,28 @@
 #include <poll.h>
 
 struct poll_loop_t {
+    using clock = std::chrono::steady_clock;
     struct awaiter;
 
     awaiter wait_events(int fd, short events);
     auto wait_read(int fd);
     auto wait_write(int fd);
+    // Awaiting these returns false if the deadline has passed before any events
+    awaiter wait_events_until(int fd, short events, clock::time_point deadline);
+    auto wait_read_until(int fd, clock::time_point deadline);
+    auto wait_write_until(int fd, clock::time_point deadline);
+    auto wait_read_for(int fd, double ms);
+    auto wait_write_for(int fd, double ms);
 
     void think();
     bool has_tasks() const { return !suspended.empty(); }
 
 private:
+    int poll_timeout() const;
     void swap_remove(size_t i);
     std::vector<std::coroutine_handle<>> suspended;
     std::vector<pollfd> pfds;
+    std::vector<awaiter*> awaiters;
 };
 
 inline thread_local poll_loop_t poll_loop;
@@ -36,11 +46,14 @@ struct poll_loop_t::awaiter {
     void await_suspend(std::coroutine_handle<> h) {
         this->resumer->suspended.push_back(h);
         this->resumer->pfds.push_back(pfd);
+        this->resumer->awaiters.push_back(this);
     }
-    void await_resume() const {}
+    // Returns false on timeout
+    bool await_resume() const { return pfd.revents != 0; }
 
     poll_loop_t* resumer;
     pollfd pfd;
+    clock::time_point deadline = clock::time_point::max();
 };
 
 
@@ -58,28 +71,59 @@ inline poll_loop_t::awaiter poll_loop_t::wait_events(int fd, short events) {
 inline auto poll_loop_t::wait_read(int fd) { return wait_events(fd, POLLIN); }
 inline auto poll_loop_t::wait_write(int fd) { return wait_events(fd, POLLOUT); }
 
+inline poll_loop_t::awaiter poll_loop_t::wait_events_until(int fd, short events, clock::time_point deadline) {
+    awaiter ret = wait_events(fd, events);
+    ret.deadline = deadline;
+    return ret;
+}
+
+inline auto poll_loop_t::wait_read_until(int fd, clock::time_point deadline) { return wait_events_until(fd, POLLIN, deadline); }
+inline auto poll_loop_t::wait_write_until(int fd, clock::time_point deadline) { return wait_events_until(fd, POLLOUT, deadline); }
+
+inline auto poll_loop_t::wait_read_for(int fd, double ms) {
+    return wait_read_until(fd, clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(ms)));
+}
+inline auto poll_loop_t::wait_write_for(int fd, double ms) {
+    return wait_write_until(fd, clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(ms)));
+}
+
 inline void poll_loop_t::think() {
-    const int n_resumeable = poll(pfds.data(), pfds.size(), -1);
+    const int n_resumeable = poll(pfds.data(), pfds.size(), poll_timeout());
     if (n_resumeable == -1) {
         throw std::runtime_error(std::string("poll() failed: ") + strerror(errno));
     }
-    if (n_resumeable > 0) {
-        int n_left = n_resumeable;
-        for (size_t i = 0; i < suspended.size(); ) {
-            if (pfds[i].revents != 0) {
-                suspended[i].resume();
-                swap_remove(i);
-                if (--n_left == 0) { break; }
-            } else {
-                i++;
-            }
+    const auto now = clock::now();
+    for (size_t i = 0; i < suspended.size(); ) {
+        if (pfds[i].revents != 0 || awaiters[i]->deadline <= now) {
+            // Remove before resuming, the coroutine may suspend again
+            auto h = suspended[i];
+            awaiters[i]->pfd.revents = pfds[i].revents;
+            swap_remove(i);
+            h.resume();
+        } else {
+            i++;
         }
     }
 }
 
+// Milliseconds until the nearest deadline, or -1 for none
+inline int poll_loop_t::poll_timeout() const {
+    auto nearest = clock::time_point::max();
+    for (const awaiter* a : awaiters) {
+        if (a->deadline < nearest) { nearest = a->deadline; }
+    }
+    if (nearest == clock::time_point::max()) {
+        return -1;
+    }
+    const auto left = std::chrono::ceil<std::chrono::milliseconds>(nearest - clock::now()).count();
+    return left < 0 ? 0 : left;
+}
+
 inline void poll_loop_t::swap_remove(size_t i) {
     std::swap(suspended[i], suspended.back());
     std::swap(pfds[i], pfds.back());
+    std::swap(awaiters[i], awaiters.back());
     suspended.pop_back();
     pfds.pop_back();
+    awaiters.pop_back();
 }
@@ -9,6 +9,14 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <optional>
+#include <span>
+#include <vector>
 
 // All functions are nonblocking and expect a nonblocking socket
 namespace async::c_api {
@@ -16,6 +24,10 @@ namespace async::c_api {
         virtual const char* what() const noexcept override { return "end of stream"; }
     };
 
+    struct timeout : std::exception {
+        virtual const char* what() const noexcept override { return "operation timed out"; }
+    };
+
     // Transparent RAII wrapper around a file descriptor
     class fd {
         int value = -1;
@@ -23,6 +35,7 @@ namespace async::c_api {
         explicit fd(int fd) noexcept : value(fd) {}
         fd(const fd&) = delete;
         fd(fd&& o) noexcept { std::swap(value, o.value); }
+        fd& operator=(fd&& o) noexcept { std::swap(value, o.value); return *this; }
         ~fd() noexcept { if (value != -1) { ::close(value); } }
         operator int() const& { return value; }
         operator int() && = delete;
@@ -30,6 +43,20 @@ namespace async::c_api {
         int release() { int ret = -1; std::swap(ret, value); return ret; }
     };
 
+    // Read-only memory mapping of a whole file
+    class mapping {
+        void* addr = nullptr;
+        size_t len = 0;
+    public:
+        mapping() = default;
+        mapping(void* addr, size_t len) noexcept : addr(addr), len(len) {}
+        mapping(const mapping&) = delete;
+        mapping(mapping&& o) noexcept { std::swap(addr, o.addr); std::swap(len, o.len); }
+        mapping& operator=(mapping&& o) noexcept { std::swap(addr, o.addr); std::swap(len, o.len); return *this; }
+        ~mapping() noexcept { if (addr) { ::munmap(addr, len); } }
+        std::string_view view() const { return {static_cast<const char*>(addr), len}; }
+    };
+
     // Returns number of bytes written (may be zero)
     inline size_t write(int fd, std::string_view data) {
         ssize_t n_sent = ::write(fd, data.data(), data.size());
@@ -41,6 +68,29 @@ namespace async::c_api {
         ex::wrape(n_sent, "write()");
         return n_sent;
     }
+    // Gathering write() of all parts, returns number of bytes written (may be zero)
+    inline size_t writev(int fd, std::span<const iovec> parts) {
+        ssize_t n_sent = ::writev(fd, parts.data(), parts.size());
+        if (n_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (n_sent == -1 && errno == EPIPE) {
+            throw eof();
+        }
+        ex::wrape(n_sent, "writev()");
+        return n_sent;
+    }
+    // Moves up to len bytes from fd_in to fd_out inside the kernel, one of them must be a pipe.
+    // Returns number of bytes moved (may be zero)
+    inline size_t splice(int fd_in, int fd_out, size_t len) {
+        ssize_t n_moved = ::splice(fd_in, nullptr, fd_out, nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n_moved == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (n_moved == 0) {
+            throw eof();
+        }
+        ex::wrape(n_moved, "splice()");
+        return n_moved;
+    }
     // Returns number of bytes read (may be zero)
     inline size_t read(int fd, void* buf, size_t size) {
         ssize_t n_read = ::read(fd, buf, size);
@@ -82,9 +132,8 @@ namespace async::c_api {
     // Returns a non-blocking fd
     [[nodiscard]]
     inline fd open(std::string_view pathname, int flags, mode_t mode = 00666) {
-        c_api::fd fd {ex::wrape(::open(std::string(pathname).c_str(), flags, mode), "open()")};
-        c_api::fcntl(fd, F_SETFL, O_NONBLOCK);
-        return fd;
+        // Not F_SETFL afterwards, that would clear O_APPEND
+        return c_api::fd {ex::wrape(::open(std::string(pathname).c_str(), flags | O_NONBLOCK, mode), "open()")};
     }
     // Returns a non-blocking fd
     [[nodiscard]]
@@ -93,6 +142,13 @@ namespace async::c_api {
         c_api::fcntl(fd, F_SETFL, O_NONBLOCK);
         return fd;
     }
+    // Blocking fds, read end first
+    [[nodiscard]]
+    inline std::pair<fd, fd> pipe() {
+        int fds[2];
+        ex::wrape(::pipe2(fds, O_CLOEXEC), "pipe2()");
+        return {fd(fds[0]), fd(fds[1])};
+    }
     // Returns a non-blocking fd
     [[nodiscard]]
     inline fd timerfd_create(int clockfd = CLOCK_MONOTONIC, int flags = 0) {
@@ -103,6 +159,42 @@ namespace async::c_api {
     inline void timerfd_settime(int fd, int flags, const itimerspec& new_value, struct itimerspec* old_value = nullptr) {
         ex::wrape(::timerfd_settime(fd, flags, &new_value, old_value), "timerfd_settime()");
     }
+    // Returns a non-blocking fd
+    [[nodiscard]]
+    inline fd eventfd(unsigned int initval = 0, int flags = 0) {
+        return c_api::fd {ex::wrape(::eventfd(initval, flags | EFD_NONBLOCK | EFD_CLOEXEC), "eventfd()")};
+    }
+    inline void eventfd_write(int fd, uint64_t value) {
+        ex::wrape(::eventfd_write(fd, value), "eventfd_write()");
+    }
+    // Returns 0 if the counter is zero
+    [[nodiscard]]
+    inline uint64_t eventfd_read(int fd) {
+        eventfd_t value;
+        if (::eventfd_read(fd, &value) == -1) {
+            if (errno == EAGAIN) { return 0; }
+            throw ex::fn("eventfd_read()", strerror(errno));
+        }
+        return value;
+    }
+    [[nodiscard]]
+    inline struct stat fstat(int fd) {
+        struct stat ret;
+        ex::wrape(::fstat(fd, &ret), "fstat()");
+        return ret;
+    }
+    // Maps a whole file read-only, blocks on page faults like any file read
+    [[nodiscard]]
+    inline mapping mmap_file(std::string_view pathname) {
+        c_api::fd fd {ex::wrape(::open(std::string(pathname).c_str(), O_RDONLY | O_CLOEXEC), "open()")};
+        const size_t len = c_api::fstat(fd).st_size;
+        if (len == 0) { return {}; }
+        void* addr = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            throw ex::fn("mmap()", strerror(errno));
+        }
+        return {addr, len};
+    }
     // Optional, use to close a descriptor early
     inline void close(fd& fd) noexcept {
         ::close(fd.release());
@@ -137,6 +229,26 @@ namespace async::c_api {
     inline std::string inet_htop(int af, uint32_t ip) {
         return c_api::inet_ntop(af, in_addr{htonl(ip)});
     }
+    [[nodiscard]]
+    inline in6_addr inet_pton6(std::string_view ip) {
+        in6_addr ret;
+        int res = ::inet_pton(AF_INET6, std::string(ip).c_str(), &ret);
+        if (res == 0) {
+            throw ex::fn("inet_pton()");
+        } else if (res == -1) {
+            throw ex::fn("inet_pton()", strerror(errno));
+        }
+        return ret;
+    }
+    // addr points to 16 bytes in network order
+    [[nodiscard]]
+    inline std::string inet_ntop6(const void* addr) {
+        char buf[INET6_ADDRSTRLEN];
+        if (!::inet_ntop(AF_INET6, addr, buf, sizeof(buf))) {
+            throw ex::fn("inet_ntop()", strerror(errno));
+        }
+        return buf;
+    }
     // Returns a non-blocking socket, ip may be nullptr for INADDR_ANY
     [[nodiscard]]
     inline fd bind_listen(std::string_view ip, uint16_t port) {
@@ -152,6 +264,143 @@ namespace async::c_api {
         ex::wrape(::listen(fd, 256), "listen()");
         return fd;
     }
+    [[nodiscard]]
+    inline sockaddr_in make_sockaddr_in(std::string_view ip, uint16_t port) {
+        return {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr = c_api::inet_pton(AF_INET, ip),
+            .sin_zero = {},
+        };
+    }
+    inline bool same_address(const sockaddr_in& a, const sockaddr_in& b) {
+        return a.sin_port == b.sin_port && a.sin_addr.s_addr == b.sin_addr.s_addr;
+    }
+    // Returns a non-blocking UDP socket bound to ip:port
+    [[nodiscard]]
+    inline fd bind_udp(std::string_view ip, uint16_t port) {
+        c_api::fd fd {c_api::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)};
+        sockaddr_in addr = c_api::make_sockaddr_in(ip, port);
+        ex::wrape(::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), "bind()");
+        return fd;
+    }
+    // Returns number of bytes sent (zero if the socket buffer is full)
+    inline size_t sendto(int fd, std::string_view data, const sockaddr_in& to) {
+        ssize_t n_sent = ::sendto(fd, data.data(), data.size(), MSG_NOSIGNAL,
+            reinterpret_cast<const sockaddr*>(&to), sizeof(to));
+        if (n_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        ex::wrape(n_sent, "sendto()");
+        return n_sent;
+    }
+    // Returns size of the datagram, or nullopt if there is none
+    inline std::optional<size_t> recvfrom(int fd, void* buf, size_t size, sockaddr_in& from) {
+        socklen_t len = sizeof(from);
+        ssize_t n_read = ::recvfrom(fd, buf, size, 0, reinterpret_cast<sockaddr*>(&from), &len);
+        if (n_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return std::nullopt;
+        }
+        ex::wrape(n_read, "recvfrom()");
+        return n_read;
+    }
+    // Path starting with '@' is in the abstract namespace (linux-specific)
+    [[nodiscard]]
+    inline std::pair<sockaddr_un, socklen_t> make_sockaddr_un(std::string_view path) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        const bool abstract = path.starts_with('@');
+        // Filesystem paths need space for a null terminator, abstract names don't
+        if (path.size() + !abstract > sizeof(addr.sun_path)) {
+            throw ex::runtime("unix socket path too long");
+        }
+        memcpy(addr.sun_path, path.data(), path.size());
+        if (abstract) { addr.sun_path[0] = '\0'; }
+        socklen_t len = offsetof(sockaddr_un, sun_path) + path.size() + !abstract;
+        return {addr, len};
+    }
+    // Returns a non-blocking socket, type is SOCK_STREAM or SOCK_SEQPACKET
+    [[nodiscard]]
+    inline fd bind_listen_unix(std::string_view path, int type) {
+        c_api::fd fd {c_api::socket(AF_UNIX, type, 0)};
+        auto [addr, len] = c_api::make_sockaddr_un(path);
+        ex::wrape(::bind(fd, reinterpret_cast<sockaddr*>(&addr), len), "bind()");
+        ex::wrape(::listen(fd, 256), "listen()");
+        return fd;
+    }
+    // Returns a connected pair of non-blocking unix sockets
+    [[nodiscard]]
+    inline std::pair<fd, fd> socketpair(int type) {
+        int fds[2];
+        ex::wrape(::socketpair(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds), "socketpair()");
+        return {fd(fds[0]), fd(fds[1])};
+    }
+    // Sends data with fds attached as SCM_RIGHTS.
+    // Returns number of bytes written (may be zero, in which case no fds were sent)
+    inline size_t sendmsg_fds(int fd, std::string_view data, std::span<const int> fds) {
+        iovec iov = {
+            .iov_base = const_cast<char*>(data.data()),
+            .iov_len = data.size(),
+        };
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (!fds.empty()) {
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        }
+        ssize_t n_sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (n_sent == -1 && errno == EPIPE) {
+            throw eof();
+        }
+        ex::wrape(n_sent, "sendmsg()");
+        return n_sent;
+    }
+    // Received fds are appended to fds_out as they are: their status flags, O_NONBLOCK included,
+    // belong to the open file description shared with the sender, so they aren't changed here.
+    // truncated is set if the sender attached more than max_fds, the kernel closes the rest.
+    // Returns number of bytes read (may be zero)
+    inline size_t recvmsg_fds(int fd, void* buf, size_t size, std::vector<c_api::fd>& fds_out, bool& truncated,
+                              size_t max_fds = 16) {
+        iovec iov = {
+            .iov_base = buf,
+            .iov_len = size,
+        };
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * max_fds));
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        ssize_t n_read = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        ex::wrape(n_read, "recvmsg()");
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) { continue; }
+            const size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < n_fds; i++) {
+                int received;
+                memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                fds_out.emplace_back(received);
+            }
+        }
+        // The data has been consumed either way, so it's returned rather than thrown away
+        truncated = truncated || (msg.msg_flags & MSG_CTRUNC);
+        if (n_read == 0) {
+            throw eof();
+        }
+        return n_read;
+    }
     // Returns accepted socket or -1
     [[nodiscard]]
     inline fd accept(int fd) {
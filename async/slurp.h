@@ -1,113 +1,60 @@
 #include "file.h"
-#include "tcp.h"
-#include "tls.h"
-#include <http.h>
+#include "http_client.h"
+#include <sys/stat.h>
 
-namespace async::detail {
-    struct uri_view {
-        std::optional<std::string_view> proto;
-        std::optional<std::string_view> host;
-        std::optional<uint16_t> port;
-        std::optional<std::string_view> path;
+namespace async {
+    struct fetch_result {
+        // 0 for files
+        unsigned status = 0;
+        std::vector<std::pair<std::string, std::string>> headers;
+        uint64_t bytes = 0;
+        // Of those, bytes spliced from the socket into the file without copying
+        uint64_t spliced = 0;
     };
+}
 
-    inline auto parse_host_port(std::string_view host_port) {
-        std::pair<std::string_view, std::optional<std::string_view>> ret;
-        const auto i_colon = host_port.find(':');
-        if (i_colon != host_port.npos) {
-            ret.first = host_port.substr(0, i_colon);
-            ret.second = host_port.substr(i_colon + 1);
-        } else {
-            ret.first = host_port;
-        }
-        return ret;
-    }
-
-    inline uri_view parse_uri(std::string_view uri) {
-        const auto i_proto_end = uri.find("://");
-        if (i_proto_end == uri.npos) {
-            return {
-                .proto = std::nullopt,
-                .host = std::nullopt,
-                .port = std::nullopt,
-                .path = uri,
-            };
-        }
-        const auto proto = uri.substr(0, i_proto_end);
-        // handle path with no proto but :// in path
-        for (auto c : proto) {
-            if (!isalnum(c)) {
-                return {
-                    .proto = std::nullopt,
-                    .host = std::nullopt,
-                    .port = std::nullopt,
-                    .path = uri,
-                };
-            }
-        }
-        const auto i_host_start = i_proto_end + 3;
-        auto i_host_end = uri.find("/", i_host_start);
-        if (i_host_end == uri.npos) {
-            i_host_end = uri.size();
-        }
-        const auto host_port = uri.substr(i_host_start, i_host_end - i_host_start);
-        const auto [host, opt_port] = parse_host_port(host_port);
-        const auto path = uri.substr(i_host_end);
-        std::optional<uint16_t> opt_port_num;
-        if (opt_port) {
-            if (opt_port->size() > 5) {
-                throw ex::runtime("invalid uri port");
-            }
-            opt_port_num = std::stoi(std::string(*opt_port));
-        }
+namespace async::detail {
+    // Sinks for fetch(): a file stream, spliced into when possible, any other stream,
+    // or a callable taking std::string_view and returning void or task<void>
+    inline http::body_sink make_body_sink(stream<transport::file>& out) {
+        const int fd = out.transport.fd_handle;
+        struct stat st;
+        // Not pipes, a full one would leave splice_body() spinning
+        const bool can_splice = ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            (::fcntl(fd, F_GETFL) & O_APPEND) == 0;
         return {
-            .proto = proto,
-            .host = host,
-            .port = opt_port_num,
-            .path = !path.empty() ? std::optional{path} : std::nullopt,
+            .write = [&out] (std::string_view data) -> task<void> { co_await out.write(data); },
+            .splice_fd = can_splice ? fd : -1,
+            .written = 0,
+            .spliced = 0,
         };
     }
 
-    inline task<std::string> slurp_http_https(const uri_view& uri, size_t level);
-
-    inline task<std::string> slurp_http_stream(auto stream, const uri_view& uri, size_t level) {
-        // using HTTP/1.0 to avoid chunked encoding
-        co_await stream.write(fmt_raw(
-            "GET ", uri.path.value_or("/"), " HTTP/1.0\r\n",
-            "Host: ", uri.host.value(), "\r\n",
-            "\r\n"));
-        auto buf = co_await stream.read_until_eof();
-        http::view resp {buf};
-        if (resp.response_code.size() != 3) {
-            throw ex::runtime("server returned malformed error status");
-        }
-        if (resp.response_code == "200") {
-            co_return std::string(resp.body);
-        } else if (resp.response_code.starts_with("30")) {
-            std::string_view new_url = resp.get("Location");
-            co_return co_await slurp_http_https(parse_uri(new_url), level + 1);
-        } else {
-            std::string_view c = resp.response_code;
-            bool print_code = isdigit(c[0]) && isdigit(c[1]) && isdigit(c[2]);
-            if (print_code) {
-                throw ex::runtime("server returned error status", std::stoi(std::string(c)));
-            } else {
-                throw ex::runtime("server returned malformed error status");
-            }
-        }
+    template <typename Transport>
+    http::body_sink make_body_sink(stream<Transport>& out) {
+        return {
+            .write = [&out] (std::string_view data) -> task<void> { co_await out.write(data); },
+            .splice_fd = -1,
+            .written = 0,
+            .spliced = 0,
+        };
     }
 
-    inline task<std::string> slurp_http_https(const uri_view& uri, size_t level) {
-        if (level >= 16) {
-            throw ex::runtime("http redirect recursion too deep");
-        }
-        if (uri.proto == "https") {
-            stream stream = co_await tls::connect(uri.host.value(), uri.port.value_or(443));
-            co_return co_await slurp_http_stream(std::move(stream), uri, level);
-        } else {
-            stream stream = co_await tcp::connect(uri.host.value(), uri.port.value_or(80));
-            co_return co_await slurp_http_stream(std::move(stream), uri, level);
-        }
+    template <typename Callback>
+        requires std::invocable<Callback&, std::string_view>
+    http::body_sink make_body_sink(Callback& callback) {
+        return {
+            .write = [&callback] (std::string_view data) -> task<void> {
+                if constexpr (std::is_void_v<std::invoke_result_t<Callback&, std::string_view>>) {
+                    callback(data);
+                } else {
+                    co_await callback(data);
+                }
+            },
+            .splice_fd = -1,
+            .written = 0,
+            .spliced = 0,
+        };
     }
 }
 
@@ -115,12 +62,55 @@ namespace async {
     inline task<std::string> slurp(std::string_view path) {
         detail::uri_view uri = detail::parse_uri(path);
         if (uri.proto == "http" || uri.proto == "https") {
-            co_return co_await detail::slurp_http_https(uri, 0);
-        } else if (uri.proto->empty() || uri.proto == "file") {
+            http::response resp = co_await http::detail::shared_client.get(path);
+            if (resp.status != 200) {
+                throw ex::runtime("server returned error status", resp.status);
+            }
+            co_return std::move(resp.body);
+        } else if (!uri.proto || uri.proto == "file") {
             stream stream = co_await file::open_read(uri.path.value());
             co_return co_await stream.read_until_eof();
         } else {
             throw ex::runtime("slurp protocol not supported");
         }
     }
+
+    // Like slurp(), but the contents go to sink as they arrive, so memory use doesn't depend
+    // on their size. Non-2xx statuses throw before anything is written.
+    template <typename Sink>
+    task<fetch_result> fetch(std::string_view path, Sink&& sink) {
+        http::body_sink body = detail::make_body_sink(sink);
+        detail::uri_view uri = detail::parse_uri(path);
+        fetch_result ret;
+        if (uri.proto == "http" || uri.proto == "https") {
+            http::response resp = co_await http::detail::shared_client.get(path, &body);
+            if (resp.status / 100 != 2) {
+                throw ex::runtime("server returned error status", resp.status);
+            }
+            ret.status = resp.status;
+            ret.headers = std::move(resp.headers);
+        } else if (!uri.proto || uri.proto == "file") {
+            transport::file in = co_await file::open_read(uri.path.value());
+            std::string buf(64 * 1024, '\0');
+            while (true) {
+                size_t n;
+                try {
+                    n = in.read(buf.data(), buf.size());
+                } catch (const c_api::eof&) {
+                    break;
+                }
+                if (n == 0) {
+                    co_await in.wait_read();
+                    continue;
+                }
+                co_await body.write(std::string_view(buf).substr(0, n));
+                body.written += n;
+            }
+        } else {
+            throw ex::runtime("fetch protocol not supported");
+        }
+        ret.bytes = body.written;
+        ret.spliced = body.spliced;
+        co_return ret;
+    }
 }
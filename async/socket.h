@@ -4,15 +4,8 @@
 #include "posix_wrappers.h"
 
 namespace async::detail {
-    inline task<c_api::fd> make_connected_socket(std::string_view ip, uint16_t port, int type, int protocol) {
-        c_api::fd fd = c_api::socket(AF_INET, type, protocol);
-        sockaddr_in addr = {
-            .sin_family = AF_INET,
-            .sin_port = htons(port),
-            .sin_addr = c_api::inet_pton(AF_INET, ip),
-            .sin_zero = {},
-        };
-        int res = ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    inline task<void> connect_socket(const c_api::fd& fd, const sockaddr* addr, socklen_t addrlen) {
+        int res = ::connect(fd, addr, addrlen);
         if (res == -1) {
             if (errno != EINPROGRESS) {
                 throw ex::fn("connect()", strerror(errno));
@@ -23,6 +16,38 @@ namespace async::detail {
                 throw ex::fn("connect()", strerror(err));
             }
         }
+    }
+
+    // ip is IPv6 if it contains ':'
+    inline task<c_api::fd> make_connected_socket(std::string_view ip, uint16_t port, int type, int protocol) {
+        if (ip.find(':') != std::string_view::npos) {
+            c_api::fd fd = c_api::socket(AF_INET6, type, protocol);
+            sockaddr_in6 addr = {
+                .sin6_family = AF_INET6,
+                .sin6_port = htons(port),
+                .sin6_flowinfo = 0,
+                .sin6_addr = c_api::inet_pton6(ip),
+                .sin6_scope_id = 0,
+            };
+            co_await connect_socket(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+            co_return fd;
+        }
+        c_api::fd fd = c_api::socket(AF_INET, type, protocol);
+        sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr = c_api::inet_pton(AF_INET, ip),
+            .sin_zero = {},
+        };
+        co_await connect_socket(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        co_return fd;
+    }
+
+    // Path starting with '@' is in the abstract namespace
+    inline task<c_api::fd> make_connected_unix_socket(std::string_view path, int type) {
+        c_api::fd fd = c_api::socket(AF_UNIX, type, 0);
+        auto [addr, len] = c_api::make_sockaddr_un(path);
+        co_await connect_socket(fd, reinterpret_cast<sockaddr*>(&addr), len);
         co_return fd;
     }
 }
@@ -1,6 +1,14 @@
 #pragma once
 #include "coro.h"
 #include "posix_wrappers.h"
+#include <span>
+
+namespace async::detail {
+    // Transports exposing their internal buffers through
+    // peek_read() / consume_read() / reserve_write() / commit_write()
+    template <typename Transport>
+    concept borrowed_buffers_transport = Transport::has_borrowed_buffers;
+}
 
 namespace async {
     template <typename Transport>
@@ -90,6 +98,58 @@ namespace async {
                 data = data.substr(transport.write(data));
             }
         }
+
+        // Returns at least one byte of input without copying it out of the transport.
+        // The view is valid until the next call on this stream,
+        // call consume() with the number of bytes used.
+        task<std::string_view> read_borrowed() {
+            if (!buffer.empty()) {
+                borrowed_from_transport = false;
+                co_return buffer.view();
+            }
+            if constexpr (detail::borrowed_buffers_transport<Transport>) {
+                co_await transport.wait_read();
+                borrowed_from_transport = true;
+                auto data = transport.peek_read();
+                co_return std::string_view(data.data(), data.size());
+            } else {
+                while (buffer.empty()) {
+                    co_await read_some(buffer.storage());
+                }
+                borrowed_from_transport = false;
+                co_return buffer.view();
+            }
+        }
+        void consume(size_t n) {
+            if constexpr (detail::borrowed_buffers_transport<Transport>) {
+                if (borrowed_from_transport) {
+                    transport.consume_read(n);
+                    return;
+                }
+            }
+            buffer.consume(n);
+        }
+
+        // Returns space to serialize output into in place, call commit() with
+        // the number of bytes written and flush() when done
+        task<std::span<char>> write_buffer() {
+            if constexpr (detail::borrowed_buffers_transport<Transport>) {
+                co_await transport.wait_write();
+                co_return transport.reserve_write();
+            } else {
+                write_staging.resize(staging_size);
+                co_return std::span<char>(write_staging);
+            }
+        }
+        task<void> commit(size_t n) {
+            if constexpr (detail::borrowed_buffers_transport<Transport>) {
+                transport.commit_write(n);
+                co_return;
+            } else {
+                co_await write_part({write_staging.data(), n});
+            }
+        }
+
         task<void> flush() { co_await transport.flush(); }
         task<void> close() { co_await transport.close(); }
         stream(Transport transport) : transport(std::move(transport)) {}
@@ -121,6 +181,21 @@ namespace async {
             bool empty() const {
                 return raw_buffer.empty();
             }
+            std::string_view view() const {
+                return buffer();
+            }
+            void consume(size_t n) {
+                start += n;
+                if (start >= raw_buffer.size()) {
+                    raw_buffer.clear();
+                    start = 0;
+                }
+            }
+            // Only valid to append to while empty
+            std::string& storage() {
+                assert(empty());
+                return raw_buffer;
+            }
         private:
             std::string_view buffer() const {
                 return std::string_view{raw_buffer}.substr(start);
@@ -129,7 +204,13 @@ namespace async {
             size_t start = 0;
         };
     private:
+        static constexpr size_t staging_size = 16384;
+
         queue_buffer buffer;
+        // Source of the last read_borrowed() view
+        bool borrowed_from_transport = false;
+        // write_buffer() space for transports without borrowed buffers
+        std::string write_staging;
     };
 
     template <typename Transport>
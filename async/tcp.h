@@ -1,16 +1,31 @@
 #pragma once
 #include "stream.h"
 #include "dns.h"
+#include <array>
+#include <memory>
+#include <random>
+#include <unordered_map>
 
 namespace async::transport {
     class tcp_socket {
     public:
         explicit tcp_socket(c_api::fd fd_handle) : fd_handle(std::move(fd_handle)) {}
+        tcp_socket(tcp_socket&&) = default;
+        tcp_socket& operator=(tcp_socket&& o) noexcept {
+            // Swapped like the fd so a watch stays with the socket that owns its number
+            std::swap(fd_handle, o.fd_handle);
+            std::swap(watched, o.watched);
+            timeout_ms = o.timeout_ms;
+            deadline = o.deadline;
+            return *this;
+        }
+        ~tcp_socket() { unwatch(); }
 
-        task<void> wait_read() { co_await poll_loop.wait_read(fd_handle); }
-        task<void> wait_write() { co_await poll_loop.wait_write(fd_handle); }
+        task<void> wait_read() { co_await wait_events(POLLIN); }
+        task<void> wait_write() { co_await wait_events(POLLOUT); }
         size_t read(void* buf, size_t size) { return c_api::read(fd_handle, buf, size); }
         size_t write(std::string_view data) { return c_api::write(fd_handle, data); }
+        size_t writev(std::span<const iovec> parts) { return c_api::writev(fd_handle, parts); }
 
         task<void> flush() {
             // Assuming TCP_CORK is set
@@ -18,6 +33,7 @@ namespace async::transport {
             co_return;
         }
         task<void> close() {
+            unwatch();
             c_api::close(fd_handle);
             co_return;
         }
@@ -25,8 +41,45 @@ namespace async::transport {
         static constexpr bool has_lookahead = true;
         size_t available_bytes() { return c_api::available_bytes(fd_handle); }
 
+        // Waits throw c_api::timeout when nothing happens for this long, 0 disables
+        void set_timeout(double ms) { timeout_ms = ms; }
+        // Waits throw c_api::timeout after this point
+        void set_deadline(poll_loop_t::clock::time_point tp) { deadline = tp; }
+        void clear_deadline() { deadline = poll_loop_t::clock::time_point::max(); }
+
+        int native_handle() const { return fd_handle; }
+        // The fd number while this socket owns it, -1 once it's closed or destroyed,
+        // so others can act on the socket later without hitting a reused number
+        std::shared_ptr<const int> watch() {
+            if (!watched) { watched = std::make_shared<int>(fd_handle); }
+            return watched;
+        }
+
+    private:
+        void unwatch() noexcept {
+            if (watched) { *watched = -1; }
+            watched.reset();
+        }
+        task<void> wait_events(short events) {
+            if (timeout_ms == 0 && deadline == poll_loop_t::clock::time_point::max()) {
+                co_await poll_loop.wait_events(fd_handle, events);
+                co_return;
+            }
+            auto tp = deadline;
+            if (timeout_ms != 0) {
+                using namespace std::chrono;
+                tp = std::min(tp, poll_loop_t::clock::now() + duration_cast<poll_loop_t::clock::duration>(duration<double, std::milli>(timeout_ms)));
+            }
+            if (!co_await poll_loop.wait_events_until(fd_handle, events, tp)) {
+                throw c_api::timeout();
+            }
+        }
+
     private:
         c_api::fd fd_handle;
+        std::shared_ptr<int> watched;
+        double timeout_ms = 0;
+        poll_loop_t::clock::time_point deadline = poll_loop_t::clock::time_point::max();
     };
 }
 
@@ -34,9 +87,23 @@ namespace async::tcp {
     class server {
     public:
         task<transport::tcp_socket> accept() {
-            co_await poll_loop.wait_read(server_fd);
-            co_return transport::tcp_socket(c_api::accept(server_fd));
+            while (true) {
+                co_await wait();
+                if (auto sock = try_accept()) {
+                    co_return std::move(*sock);
+                }
+            }
         }
+        // Returns nullopt if there are no pending connections
+        std::optional<transport::tcp_socket> try_accept() {
+            c_api::fd fd = c_api::accept(server_fd);
+            if (!fd) { return std::nullopt; }
+            return transport::tcp_socket(std::move(fd));
+        }
+        // Waits until there is a pending connection
+        task<void> wait() { co_await poll_loop.wait_read(server_fd); }
+        // Wakes up waiters, all further accepts fail
+        void shutdown() { ::shutdown(server_fd, SHUT_RD); }
         static server from_fd(c_api::fd fd) { return server{std::move(fd)}; }
     private:
         explicit server(c_api::fd fd) : server_fd(std::move(fd)) {}
@@ -51,6 +118,161 @@ namespace async::tcp {
         co_return transport::tcp_socket(std::move(fd));
     }
 
+    enum class balance_t : uint8_t {
+        round_robin,
+        random,
+        // Fewest failed connects in a row, round robin among equals
+        least_failures,
+    };
+
+    struct balance_options {
+        balance_t policy = balance_t::round_robin;
+        // AF_INET, AF_INET6 or AF_UNSPEC for both
+        int family = AF_INET;
+        // More addresses tried after a failed connect
+        size_t failover = 2;
+        // Addresses are resolved again after their TTL, but not more often than this
+        uint32_t min_ttl_s = 1;
+    };
+
+    struct backend_stats {
+        std::string ip;
+        size_t connects = 0;
+        size_t failures = 0;
+        // Since the last successful connect
+        size_t failures_in_row = 0;
+    };
+}
+
+namespace async::tcp::detail {
+    struct balanced_host {
+        std::vector<backend_stats> backends;
+        poll_loop_t::clock::time_point expires;
+        size_t next = 0;
+    };
+}
+
+namespace async::tcp {
+    // Spreads connections to a host over all of its addresses.
+    // If re-resolving an expired host fails, its old addresses keep being used.
+    class balancer {
+    public:
+        // Without nameservers, hosts are resolved with dns::lookup_all()
+        explicit balancer(balance_options options = {}, dns::nameserver_set* nameservers = nullptr)
+            : options(options), nameservers(nameservers) {}
+        balancer(const balancer&) = delete;
+
+        task<transport::tcp_socket> connect(std::string_view host, uint16_t port) {
+            detail::balanced_host* state = co_await resolve(host);
+            const std::vector<std::string> candidates = pick(*state);
+            std::exception_ptr error;
+            for (const auto& ip : candidates) {
+                try {
+                    c_api::fd fd = co_await async::detail::make_connected_socket(ip, port, SOCK_STREAM, IPPROTO_TCP);
+                    c_api::setsockopt(fd, IPPROTO_TCP, TCP_CORK, 1);
+                    if (auto* b = find(*state, ip)) {
+                        b->connects++;
+                        b->failures_in_row = 0;
+                    }
+                    co_return transport::tcp_socket(std::move(fd));
+                } catch (const std::exception&) {
+                    error = std::current_exception();
+                }
+                if (auto* b = find(*state, ip)) {
+                    b->failures++;
+                    b->failures_in_row++;
+                }
+            }
+            std::rethrow_exception(error);
+        }
+
+        // Empty if host wasn't connected to yet
+        std::vector<backend_stats> stats(std::string_view host) const {
+            auto iter = hosts.find(dns::detail::lowercase(host));
+            if (iter == hosts.end()) { return {}; }
+            return iter->second->backends;
+        }
+
+    private:
+        task<detail::balanced_host*> resolve(std::string_view host) {
+            const std::string key = dns::detail::lowercase(host);
+            auto& state = hosts[key];
+            if (!state) {
+                state = std::make_unique<detail::balanced_host>();
+            }
+            // The map only grows, so state stays valid across the lookup
+            detail::balanced_host* ret = state.get();
+            const auto now = poll_loop_t::clock::now();
+            if (!ret->backends.empty() && now < ret->expires) { co_return ret; }
+            try {
+                dns::address_set set;
+                if (nameservers) {
+                    set = co_await dns::detail::lookup_addresses(*nameservers, host, options.family);
+                } else {
+                    set = co_await dns::lookup_all(host, options.family);
+                }
+                if (set.addresses.empty()) {
+                    throw ex::runtime("no addresses for " + key);
+                }
+                std::vector<backend_stats> backends;
+                for (auto& address : set.addresses) {
+                    // Counters survive a refresh
+                    auto* old = find(*ret, address.ip);
+                    backends.push_back(old ? *old : backend_stats {.ip = std::move(address.ip)});
+                }
+                ret->backends = std::move(backends);
+                ret->expires = now + std::chrono::seconds(std::max(set.ttl_s, options.min_ttl_s));
+            } catch (const std::exception&) {
+                if (ret->backends.empty()) { throw; }
+            }
+            co_return ret;
+        }
+
+        // Addresses to try in order
+        std::vector<std::string> pick(detail::balanced_host& state) {
+            const size_t n = state.backends.size();
+            std::vector<size_t> order(n);
+            for (size_t i = 0; i < n; i++) {
+                order[i] = (state.next + i) % n;
+            }
+            state.next = (state.next + 1) % n;
+            if (options.policy == balance_t::random) {
+                thread_local std::default_random_engine engine(std::random_device{}());
+                std::shuffle(order.begin(), order.end(), engine);
+            } else if (options.policy == balance_t::least_failures) {
+                std::stable_sort(order.begin(), order.end(), [&] (size_t a, size_t b) {
+                    return state.backends[a].failures_in_row < state.backends[b].failures_in_row;
+                });
+            }
+            order.resize(std::min(n, options.failover + 1));
+            std::vector<std::string> ret;
+            for (size_t i : order) {
+                ret.push_back(state.backends[i].ip);
+            }
+            return ret;
+        }
+
+        // By ip, the backends may have been replaced while connecting
+        static backend_stats* find(detail::balanced_host& state, std::string_view ip) {
+            auto iter = std::ranges::find(state.backends, ip, &backend_stats::ip);
+            return iter == state.backends.end() ? nullptr : &*iter;
+        }
+
+        balance_options options;
+        dns::nameserver_set* nameservers;
+        std::unordered_map<std::string, std::unique_ptr<detail::balanced_host>> hosts;
+    };
+
+    // Through the calling thread's balancer for policy
+    inline task<transport::tcp_socket> connect(std::string_view host, uint16_t port, balance_t policy) {
+        thread_local std::array<balancer, 3> balancers = {
+            balancer({.policy = balance_t::round_robin}),
+            balancer({.policy = balance_t::random}),
+            balancer({.policy = balance_t::least_failures}),
+        };
+        co_return co_await balancers[static_cast<size_t>(policy)].connect(host, port);
+    }
+
     inline task<server> listen(std::string_view ip, uint16_t port) {
         co_return server::from_fd(c_api::bind_listen(ip, port));
     }
@@ -0,0 +1,207 @@
+#pragma once
+#include "tcp.h"
+#include "event.h"
+#include "sleep.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <unordered_map>
+
+namespace async::tcp {
+    struct serve_options {
+        // New connections are not accepted while this many are open
+        size_t max_connections = 10000;
+        // Connections with no reads or writes for this long are dropped, 0 disables
+        double idle_timeout_ms = 0;
+        // Deadline counting from accept, 0 disables.
+        // Handlers may extend or clear it with set_deadline() / clear_deadline()
+        // once they've read the request.
+        double read_deadline_ms = 0;
+        // Accepting is paused for backoff_min_ms after an accept error
+        // (e.g. EMFILE), doubling on every consecutive error up to backoff_max_ms
+        double backoff_min_ms = 5;
+        double backoff_max_ms = 1000;
+        // After stop(), connections still open after this long are shut down
+        double drain_timeout_ms = 30000;
+        // Handlers still running this long after the shutdown are abandoned:
+        // serve() returns and they finish in the background
+        double force_timeout_ms = 1000;
+        // Max connections accepted per wakeup
+        size_t accept_batch = 64;
+    };
+
+    struct serve_stats {
+        size_t accepted = 0;
+        size_t active = 0;
+        size_t peak_active = 0;
+        size_t completed = 0;
+        size_t failed = 0;          // handler threw
+        size_t timed_out = 0;       // handler threw c_api::timeout
+        size_t accept_errors = 0;
+        size_t backoffs = 0;        // accepting was paused by an error or the connection limit
+        size_t force_closed = 0;    // shut down after drain_timeout_ms
+        size_t abandoned = 0;       // still running force_timeout_ms after the shutdown
+    };
+
+    class serve_control {
+    public:
+        // Stops accepting new connections, serve() returns once open ones finish
+        void stop() {
+            if (stopping) { return; }
+            stopping = true;
+            wakeup.set();
+            if (listener) { listener->shutdown(); }
+        }
+        bool is_stopping() const { return stopping; }
+
+        const serve_stats& stats() const { return stats_; }
+        // Accepted connections per second, exponentially weighted over ~1 second
+        double accept_rate() const {
+            return rate * std::exp(-seconds_since(last_accept) / rate_window_s);
+        }
+
+    private:
+        template <typename Handler>
+        friend task<void> serve(server&, Handler, serve_options, serve_control&);
+        template <typename Handler>
+        friend task<void> serve_connection(std::shared_ptr<Handler>, transport::tcp_socket, std::shared_ptr<bool>, serve_control&, uint64_t);
+
+        static double seconds_since(poll_loop_t::clock::time_point tp) {
+            return std::chrono::duration<double>(poll_loop_t::clock::now() - tp).count();
+        }
+        void on_accept(std::shared_ptr<const int> fd) {
+            rate = accept_rate() + 1 / rate_window_s;
+            last_accept = poll_loop_t::clock::now();
+            stats_.accepted++;
+            stats_.active++;
+            stats_.peak_active = std::max(stats_.peak_active, stats_.active);
+            live.emplace(next_id++, std::move(fd));
+        }
+        void on_close(uint64_t id) {
+            live.erase(id);
+            stats_.active--;
+            wakeup.set();
+        }
+
+        static constexpr double rate_window_s = 1;
+
+        bool stopping = false;
+        server* listener = nullptr;
+        // Set when a connection closes or on stop()
+        event wakeup;
+        serve_stats stats_;
+        double rate = 0;
+        poll_loop_t::clock::time_point last_accept = poll_loop_t::clock::now();
+        uint64_t next_id = 0;
+        // Watches of open connections' fds, -1 once a handler has closed its socket
+        std::unordered_map<uint64_t, std::shared_ptr<const int>> live;
+    };
+
+    // Shares the handler and the abandoned flag so an abandoned connection can
+    // outlive serve() and its control without touching either
+    template <typename Handler>
+    task<void> serve_connection(std::shared_ptr<Handler> handler, transport::tcp_socket sock, std::shared_ptr<bool> abandoned, serve_control& control, uint64_t id) {
+        enum { completed, timed_out, failed } outcome = completed;
+        try {
+            co_await (*handler)(std::move(sock));
+        } catch (const c_api::timeout&) {
+            outcome = timed_out;
+        } catch (const c_api::eof&) {
+        } catch (...) {
+            outcome = failed;
+        }
+        if (*abandoned) { co_return; }
+        if (outcome == completed) {
+            control.stats_.completed++;
+        } else if (outcome == timed_out) {
+            control.stats_.timed_out++;
+        } else {
+            control.stats_.failed++;
+        }
+        control.on_close(id);
+    }
+
+    // Accepts connections and runs handler(transport::tcp_socket) -> task<void>
+    // for each one in the background until control.stop() is called.
+    // Returns after all connections have finished, or once the ones left after
+    // the drain and force timeouts have been abandoned.
+    template <typename Handler>
+    task<void> serve(server& listener, Handler handler_value, serve_options options, serve_control& control) {
+        using namespace std::chrono;
+        const auto ms = [] (double v) {
+            return duration_cast<poll_loop_t::clock::duration>(duration<double, std::milli>(v));
+        };
+        control.listener = &listener;
+        const auto handler = std::make_shared<Handler>(std::move(handler_value));
+        const auto abandoned = std::make_shared<bool>(false);
+        double backoff_ms = 0;
+        while (!control.stopping) {
+            control.wakeup.reset();
+            if (control.stats_.active >= options.max_connections) {
+                control.stats_.backoffs++;
+                co_await control.wakeup.wait();
+                continue;
+            }
+            if (backoff_ms != 0) {
+                control.stats_.backoffs++;
+                co_await control.wakeup.wait_for(backoff_ms);
+                if (control.stopping) { break; }
+            }
+            co_await listener.wait();
+            try {
+                for (size_t i = 0; i < options.accept_batch; i++) {
+                    if (control.stats_.active >= options.max_connections) { break; }
+                    auto sock = listener.try_accept();
+                    if (!sock) { break; }
+                    if (options.idle_timeout_ms != 0) {
+                        sock->set_timeout(options.idle_timeout_ms);
+                    }
+                    if (options.read_deadline_ms != 0) {
+                        sock->set_deadline(poll_loop_t::clock::now() + ms(options.read_deadline_ms));
+                    }
+                    const uint64_t id = control.next_id;
+                    control.on_accept(sock->watch());
+                    spawn(serve_connection(handler, std::move(*sock), abandoned, control, id));
+                }
+                backoff_ms = 0;
+            } catch (const std::exception&) {
+                if (control.stopping) { break; }
+                control.stats_.accept_errors++;
+                backoff_ms = std::clamp(backoff_ms * 2, options.backoff_min_ms, options.backoff_max_ms);
+            }
+        }
+
+        // Drain
+        auto deadline = poll_loop_t::clock::now() + ms(options.drain_timeout_ms);
+        bool forced = false;
+        while (control.stats_.active != 0) {
+            control.wakeup.reset();
+            const double left_ms = duration<double, std::milli>(deadline - poll_loop_t::clock::now()).count();
+            if (left_ms > 0) {
+                co_await control.wakeup.wait_for(left_ms);
+            } else if (!forced) {
+                // Make pending reads and writes fail so handlers return.
+                // Handlers that already closed their socket are left alone,
+                // its fd number may belong to something else by now.
+                for (const auto& [id, fd] : control.live) {
+                    if (*fd == -1) { continue; }
+                    ::shutdown(*fd, SHUT_RDWR);
+                    control.stats_.force_closed++;
+                }
+                forced = true;
+                deadline = poll_loop_t::clock::now() + ms(options.force_timeout_ms);
+            } else {
+                *abandoned = true;
+                control.stats_.abandoned += control.stats_.active;
+                control.stats_.active = 0;
+                control.live.clear();
+            }
+        }
+    }
+
+    template <typename Handler>
+    task<void> serve(server& listener, Handler handler, serve_options options = {}) {
+        serve_control control;
+        co_await serve(listener, std::move(handler), options, control);
+    }
+}
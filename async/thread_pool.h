@@ -0,0 +1,142 @@
+#pragma once
+#include "coro.h"
+#include "poll_loop.h"
+#include "posix_wrappers.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+namespace async::detail {
+    // Completion doorbell shared by all thread_pool jobs awaited on one poll loop.
+    // A semaphore eventfd: every finished job adds a token, its coroutine takes one back.
+    struct pool_doorbell {
+        c_api::fd fd = c_api::eventfd(0, EFD_SEMAPHORE);
+    };
+
+    // Shared with the jobs, so a worker finishing late never writes into a closed fd
+    inline const std::shared_ptr<pool_doorbell>& loop_doorbell() {
+        thread_local const auto doorbell = std::make_shared<pool_doorbell>();
+        return doorbell;
+    }
+}
+
+namespace async {
+    // Fixed set of worker threads for CPU-heavy or blocking calls.
+    // The awaiting coroutine stays suspended in its own poll loop until the call is done.
+    class thread_pool {
+    public:
+        explicit thread_pool(size_t n_threads = std::max(1u, std::thread::hardware_concurrency())) {
+            for (size_t i = 0; i < n_threads; i++) {
+                threads.emplace_back([this] { work(); });
+            }
+        }
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+        // Finishes queued jobs first
+        ~thread_pool() {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            for (auto& t : threads) { t.join(); }
+        }
+
+        // fn must not touch state owned by other coroutines of the calling loop
+        template <typename F>
+        task<std::invoke_result_t<F&>> run(F fn) {
+            using result_t = std::invoke_result_t<F&>;
+            using stored_t = std::conditional_t<std::is_void_v<result_t>, std::monostate, result_t>;
+            struct job_state {
+                explicit job_state(F fn) : fn(std::move(fn)) {}
+                F fn;
+                std::atomic<bool> finished = false;
+                std::optional<stored_t> result;
+                std::exception_ptr error;
+            };
+            // Shared so a worker never writes into a destroyed coroutine frame
+            auto state = std::make_shared<job_state>(std::move(fn));
+            auto doorbell = detail::loop_doorbell();
+            submit([state, doorbell] {
+                try {
+                    if constexpr (std::is_void_v<result_t>) {
+                        state->fn();
+                        state->result.emplace();
+                    } else {
+                        state->result.emplace(state->fn());
+                    }
+                } catch (...) {
+                    state->error = std::current_exception();
+                }
+                // Token first, so a coroutine that sees finished always has one to take
+                c_api::eventfd_write(doorbell->fd, 1);
+                state->finished.store(true, std::memory_order_release);
+            });
+            while (!state->finished.load(std::memory_order_acquire)) {
+                co_await poll_loop.wait_read(doorbell->fd);
+                if (!state->finished.load(std::memory_order_acquire)) {
+                    // Another job's token, left for its coroutine which runs this round.
+                    // Yield one round instead of spinning on the still readable fd.
+                    co_await poll_loop.wait_read_until(-1, poll_loop_t::clock::now());
+                }
+            }
+            (void) c_api::eventfd_read(doorbell->fd);
+            if (state->error) {
+                std::rethrow_exception(state->error);
+            }
+            if constexpr (!std::is_void_v<result_t>) {
+                co_return std::move(*state->result);
+            }
+        }
+
+        size_t size() const { return threads.size(); }
+        // Jobs waiting for a free thread
+        size_t queued() {
+            std::lock_guard lock(mutex);
+            return jobs.size();
+        }
+
+        // Process-wide pool with one thread per core
+        static thread_pool& shared() {
+            static thread_pool pool;
+            return pool;
+        }
+
+    private:
+        void submit(std::function<void()> job) {
+            {
+                std::lock_guard lock(mutex);
+                jobs.push_back(std::move(job));
+            }
+            cv.notify_one();
+        }
+
+        void work() {
+            while (true) {
+                std::function<void()> job;
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+                    if (jobs.empty()) { return; }
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+                job();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::function<void()>> jobs;
+        bool stopping = false;
+        std::vector<std::thread> threads;
+    };
+}
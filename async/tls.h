@@ -2,24 +2,135 @@
 #include "stream.h"
 #include <bearssl.h>
 #include "tcp.h"
+#include "trust_store.h"
+#include "tls_profile.h"
+#include "thread_pool.h"
 #include <filesystem>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <variant>
 #include <pem.h>
 
-namespace async::transport {
-    template <typename Transport>
-    class tls_client {
+namespace async::tls {
+    class session_cache;
+
+    struct buffer_options {
+        // Use one buffer for both directions (BR_SSL_BUFSIZE_MONO instead of
+        // BR_SSL_BUFSIZE_BIDI), reads and writes then can't overlap:
+        // writing throws while decrypted input is waiting to be read
+        bool half_duplex = false;
+        // Record size, one of 512, 1024, 2048, 4096 or 16384.
+        // Smaller sizes are negotiated with the maximum fragment length extension,
+        // peers that don't support it fail on records that don't fit.
+        size_t max_fragment_len = 16384;
+        // Reuse buffers of closed connections from a per-thread pool
+        bool pooled = false;
+
+        size_t input_size() const { return max_fragment_len + (BR_SSL_BUFSIZE_INPUT - 16384); }
+        size_t output_size() const { return max_fragment_len + (BR_SSL_BUFSIZE_OUTPUT - 16384); }
+        size_t total_size() const { return half_duplex ? input_size() : input_size() + output_size(); }
+    };
+
+    struct client_options {
+        buffer_options buffers;
+        cipher_profile profile = cipher_profile::full;
+        // Free the X.509 validation context once the handshake is done
+        // and refuse renegotiation, which would need it again
+        bool release_x509 = false;
+        // Run handshake crypto (key exchange, certificate checks) here
+        // instead of on the event loop thread, must outlive the connection
+        thread_pool* crypto_pool = nullptr;
+        // Sessions for connect() to resume, instead of default_session_cache().
+        // Resumed sessions skip certificate validation, so only share a cache
+        // between connections trusting the same certificates.
+        session_cache* sessions = nullptr;
+    };
+
+    // Smallest footprint that still talks to servers without the maximum fragment length extension
+    inline constexpr client_options low_memory_client = {
+        .buffers = {
+            .half_duplex = true,
+            .max_fragment_len = 16384,
+            .pooled = true,
+        },
+        .release_x509 = true,
+    };
+}
+
+namespace async::tls::detail {
+    // Free buffers of closed connections, bounded by max_cached_bytes
+    class buffer_pool {
     public:
-        explicit tls_client(std::string_view host, std::span<const br_x509_trust_anchor> ta_list, Transport transport) : transport(std::move(transport)) {
-            iobuf.resize(BR_SSL_BUFSIZE_BIDI);
-            xc = std::make_unique<br_x509_minimal_context>();
-            cc = std::make_unique<br_ssl_client_context>();
-            br_ssl_client_init_full(cc.get(), xc.get(), ta_list.data(), ta_list.size());
-            br_ssl_engine_set_versions(&cc->eng, BR_TLS12, BR_TLS12);
-            br_ssl_engine_set_buffer(&cc->eng, iobuf.data(), iobuf.size(), 1);
-            br_ssl_client_reset(cc.get(), std::string(host).c_str(), 0);
+        static constexpr size_t max_cached_bytes = 16 * 1024 * 1024;
+
+        std::unique_ptr<uint8_t[]> take(size_t size) {
+            auto& list = free_lists[size];
+            if (list.empty()) {
+                // Not zeroed, pages of idle buffers are never touched
+                return std::make_unique_for_overwrite<uint8_t[]>(size);
+            }
+            auto ret = std::move(list.back());
+            list.pop_back();
+            cached_bytes -= size;
+            return ret;
         }
-        tls_client(const tls_client&) = delete;
-        tls_client(tls_client&&) = default;
+        void give(std::unique_ptr<uint8_t[]> buf, size_t size) {
+            if (cached_bytes + size > max_cached_bytes) { return; }
+            cached_bytes += size;
+            free_lists[size].push_back(std::move(buf));
+        }
+
+    private:
+        std::unordered_map<size_t, std::vector<std::unique_ptr<uint8_t[]>>> free_lists;
+        size_t cached_bytes = 0;
+    };
+
+    inline thread_local buffer_pool tls_buffer_pool;
+
+    class record_buffer {
+    public:
+        record_buffer() = default;
+        explicit record_buffer(size_t size, bool pooled)
+            : buf(pooled ? tls_buffer_pool.take(size) : std::make_unique_for_overwrite<uint8_t[]>(size))
+            , len(size)
+            , pooled(pooled)
+        {}
+        record_buffer(record_buffer&& o) noexcept
+            : buf(std::move(o.buf))
+            , len(std::exchange(o.len, 0))
+            , pooled(o.pooled)
+        {}
+        record_buffer& operator=(record_buffer&& o) noexcept {
+            std::swap(buf, o.buf);
+            std::swap(len, o.len);
+            std::swap(pooled, o.pooled);
+            return *this;
+        }
+        ~record_buffer() {
+            if (buf && pooled) {
+                tls_buffer_pool.give(std::move(buf), len);
+            }
+        }
+        uint8_t* data() { return buf.get(); }
+        size_t size() const { return len; }
+    private:
+        std::unique_ptr<uint8_t[]> buf;
+        size_t len = 0;
+        bool pooled = false;
+    };
+}
+
+namespace async::detail {
+    // Record layer plumbing shared by tls_client and tls_server,
+    // derived classes create the context and point eng at it
+    template <typename Transport>
+    class tls_base {
+    public:
+        explicit tls_base(Transport transport) : transport(std::move(transport)) {}
+        tls_base(const tls_base&) = delete;
+        tls_base(tls_base&&) = default;
 
         task<void> wait_read() {
             while (true) {
@@ -27,8 +138,7 @@ namespace async::transport {
                 if (st & BR_SSL_RECVAPP) {
                     co_return;
                 } else if (st & BR_SSL_RECVREC) {
-                    co_await transport.wait_read();
-                    read_records();
+                    co_await receive_records();
                 } else if (st & BR_SSL_SENDREC) {
                     co_await write_all_records();
                 } else {
@@ -45,8 +155,9 @@ namespace async::transport {
                 } else if (st & BR_SSL_SENDREC) {
                     co_await write_all_records();
                 } else if (st & BR_SSL_RECVREC) {
-                    co_await transport.wait_read();
-                    read_records();
+                    co_await receive_records();
+                } else if (st & BR_SSL_RECVAPP) {
+                    throw_input_pending();
                 } else {
                     assert(false);
                 }
@@ -64,7 +175,7 @@ namespace async::transport {
         }
 
         task<void> flush() {
-            br_ssl_engine_flush(&cc->eng, 0);
+            br_ssl_engine_flush(eng, 0);
             while (true) {
                 auto st = get_state(false);
                 if ((st & BR_SSL_SENDAPP) || (st & BR_SSL_CLOSED)) {
@@ -72,8 +183,9 @@ namespace async::transport {
                 } else if (st & BR_SSL_SENDREC) {
                     co_await write_all_records();
                 } else if (st & BR_SSL_RECVREC) {
-                    co_await transport.wait_read();
-                    read_records();
+                    co_await receive_records();
+                } else if (st & BR_SSL_RECVAPP) {
+                    throw_input_pending();
                 } else {
                     assert(false);
                 }
@@ -81,8 +193,8 @@ namespace async::transport {
         }
 
         task<void> close() {
-            br_ssl_engine_flush(&cc->eng, 0);
-            br_ssl_engine_close(&cc->eng);
+            br_ssl_engine_flush(eng, 0);
+            br_ssl_engine_close(eng);
             while (true) {
                 auto st = get_state(false);
                 if (st & BR_SSL_CLOSED) {
@@ -90,8 +202,12 @@ namespace async::transport {
                 } else if (st & BR_SSL_SENDREC) {
                     co_await write_all_records();
                 } else if (st & BR_SSL_RECVREC) {
-                    co_await transport.wait_read();
-                    read_records();
+                    co_await receive_records();
+                } else if (st & BR_SSL_RECVAPP) {
+                    // Nobody is going to read it anymore
+                    size_t len;
+                    br_ssl_engine_recvapp_buf(eng, &len);
+                    br_ssl_engine_recvapp_ack(eng, len);
                 } else {
                     assert(false);
                 }
@@ -99,20 +215,62 @@ namespace async::transport {
         }
 
         static constexpr bool has_lookahead = true;
+        // Decrypted bytes ready to be read
         size_t available_bytes() {
-            if(!(get_state() & BR_SSL_SENDAPP)) {
+            if(!(get_state() & BR_SSL_RECVAPP)) {
                 return 0;
             }
             size_t len;
-            br_ssl_engine_sendapp_buf(&cc->eng, &len);
+            br_ssl_engine_recvapp_buf(eng, &len);
             return len;
         }
 
-    private:
+        // Direct access to the engine's plaintext buffers.
+        // Spans are valid until the next call on this transport.
+        static constexpr bool has_borrowed_buffers = true;
+        // Decrypted data, empty unless wait_read() has returned
+        std::span<const char> peek_read() {
+            if (!(get_state() & BR_SSL_RECVAPP)) {
+                return {};
+            }
+            size_t len;
+            auto* buf = br_ssl_engine_recvapp_buf(eng, &len);
+            return {reinterpret_cast<const char*>(buf), len};
+        }
+        void consume_read(size_t n) {
+            if (n != 0) { br_ssl_engine_recvapp_ack(eng, n); }
+        }
+        // Space for plaintext, empty unless wait_write() has returned
+        std::span<char> reserve_write() {
+            if (!(get_state() & BR_SSL_SENDAPP)) {
+                return {};
+            }
+            size_t len;
+            auto* buf = br_ssl_engine_sendapp_buf(eng, &len);
+            return {reinterpret_cast<char*>(buf), len};
+        }
+        // A full record is encrypted right away, call flush() to send a partial one
+        void commit_write(size_t n) {
+            if (n != 0) { br_ssl_engine_sendapp_ack(eng, n); }
+        }
+
+        // Heap memory held by the record layer
+        size_t memory_usage() const { return iobuf.size(); }
+
+    protected:
+        // With a half-duplex buffer, decrypted input occupies the buffer
+        // until it is read and nothing can be sent meanwhile
+        [[noreturn]] static void throw_input_pending() {
+            throw ex::runtime("tls: unread input blocks writing on a half-duplex connection, read it first");
+        }
+
         uint16_t get_state(bool throw_ok = true) {
-            auto st = br_ssl_engine_current_state(&cc->eng);
+            auto st = br_ssl_engine_current_state(eng);
+            if (st & BR_SSL_SENDAPP) {
+                handshake_done = true;
+            }
             if (st == BR_SSL_CLOSED) {
-                int err = br_ssl_engine_last_error(&cc->eng);
+                int err = br_ssl_engine_last_error(eng);
                 if (err == BR_ERR_OK) {
                     if (throw_ok) {
                         throw c_api::eof();
@@ -138,10 +296,10 @@ namespace async::transport {
                 return;
             }
             size_t len;
-            uint8_t* buf = br_ssl_engine_sendrec_buf(&cc->eng, &len);
+            uint8_t* buf = br_ssl_engine_sendrec_buf(eng, &len);
             size_t wlen = transport.write({reinterpret_cast<const char*>(buf), len});
             if (wlen > 0) {
-                br_ssl_engine_sendrec_ack(&cc->eng, wlen);
+                br_ssl_engine_sendrec_ack(eng, wlen);
             }
         }
 
@@ -150,10 +308,10 @@ namespace async::transport {
                 return;
             }
             size_t len;
-            uint8_t* buf = br_ssl_engine_recvrec_buf(&cc->eng, &len);
+            uint8_t* buf = br_ssl_engine_recvrec_buf(eng, &len);
             size_t rlen = transport.read(buf, len);
             if (rlen > 0) {
-                br_ssl_engine_recvrec_ack(&cc->eng, rlen);
+                br_ssl_engine_recvrec_ack(eng, rlen);
             }
         }
 
@@ -163,10 +321,10 @@ namespace async::transport {
                 return 0;
             }
             size_t len;
-            uint8_t* buf = br_ssl_engine_sendapp_buf(&cc->eng, &len);
+            uint8_t* buf = br_ssl_engine_sendapp_buf(eng, &len);
             size_t rlen = std::min(len, data.size());
             memcpy(buf, data.data(), rlen);
-            br_ssl_engine_sendapp_ack(&cc->eng, rlen);
+            br_ssl_engine_sendapp_ack(eng, rlen);
             return rlen;
         }
 
@@ -176,13 +334,35 @@ namespace async::transport {
                 return 0;
             }
             size_t len;
-            uint8_t* src_buf = br_ssl_engine_recvapp_buf(&cc->eng, &len);
+            uint8_t* src_buf = br_ssl_engine_recvapp_buf(eng, &len);
             size_t rlen = std::min(dest_size, len);
             memcpy(dest_buf, src_buf, rlen);
-            br_ssl_engine_recvapp_ack(&cc->eng, rlen);
+            br_ssl_engine_recvapp_ack(eng, rlen);
             return rlen;
         }
 
+        // Handshake records are processed on crypto_pool if there is one,
+        // everything else inline. While a step runs on the pool,
+        // other coroutines must not use this connection.
+        task<void> receive_records() {
+            co_await transport.wait_read();
+            if (!crypto_pool || handshake_done) {
+                read_records();
+                co_return;
+            }
+            if (!(get_state() & BR_SSL_RECVREC)) {
+                co_return;
+            }
+            size_t len;
+            uint8_t* buf = br_ssl_engine_recvrec_buf(eng, &len);
+            size_t rlen = transport.read(buf, len);
+            if (rlen > 0) {
+                // The engine runs the handshake state machine, including all
+                // public key operations, from inside the ack
+                co_await crypto_pool->run([eng = eng, rlen] { br_ssl_engine_recvrec_ack(eng, rlen); });
+            }
+        }
+
         task<void> write_all_records() {
             bool should_flush = false;
             while (get_state() & BR_SSL_SENDREC) {
@@ -195,22 +375,454 @@ namespace async::transport {
             }
         }
 
+        // Call after pointing eng at an initialized context
+        void init_buffers(const tls::buffer_options& options) {
+            iobuf = tls::detail::record_buffer(options.total_size(), options.pooled);
+            if (options.half_duplex) {
+                br_ssl_engine_set_buffer(eng, iobuf.data(), iobuf.size(), 0);
+            } else {
+                br_ssl_engine_set_buffers_bidi(eng,
+                    iobuf.data(), options.input_size(),
+                    iobuf.data() + options.input_size(), options.output_size());
+            }
+        }
+
+    protected:
+        // Points into the derived class' heap-allocated context
+        br_ssl_engine_context* eng = nullptr;
+        tls::detail::record_buffer iobuf;
+        thread_pool* crypto_pool = nullptr;
+        bool handshake_done = false;
+
+    public:
+        Transport transport;
+    };
+}
+
+namespace async::transport {
+    template <typename Transport>
+    class tls_client : public async::detail::tls_base<Transport> {
+    public:
+        // If resume is not null, the client will try to resume that session
+        explicit tls_client(
+            std::string_view host,
+            std::span<const br_x509_trust_anchor> ta_list,
+            Transport transport,
+            const br_ssl_session_parameters* resume = nullptr,
+            const tls::client_options& options = {}
+        ) : async::detail::tls_base<Transport>(std::move(transport)) {
+            xc = std::make_unique<br_x509_minimal_context>();
+            cc = std::make_unique<br_ssl_client_context>();
+            this->eng = &cc->eng;
+            br_ssl_client_init_full(cc.get(), xc.get(), ta_list.data(), ta_list.size());
+            br_ssl_engine_set_versions(&cc->eng, BR_TLS12, BR_TLS12);
+            if (auto impls = tls::detail::apply_profile(&cc->eng, options.profile)) {
+                br_x509_minimal_set_ecdsa(xc.get(), impls->ec, impls->ecdsa_vrfy);
+            }
+            this->init_buffers(options.buffers);
+            this->crypto_pool = options.crypto_pool;
+            if (options.release_x509) {
+                br_ssl_engine_add_flags(&cc->eng, BR_OPT_NO_RENEGOTIATION);
+            }
+            if (resume) {
+                br_ssl_engine_set_session_parameters(&cc->eng, resume);
+            }
+            br_ssl_client_reset(cc.get(), std::string(host).c_str(), resume != nullptr);
+        }
+        tls_client(const tls_client&) = delete;
+        tls_client(tls_client&&) = default;
+
+        // Parameters of the current session, valid after the handshake
+        br_ssl_session_parameters session_parameters() const {
+            br_ssl_session_parameters ret;
+            br_ssl_engine_get_session_parameters(&cc->eng, &ret);
+            return ret;
+        }
+
+        // Frees the X.509 context, only valid after the handshake
+        // on a client constructed with release_x509
+        void release_x509() {
+            assert(br_ssl_engine_current_state(&cc->eng) & BR_SSL_SENDAPP);
+            xc.reset();
+        }
+
+        // Heap memory held by this connection, excluding the transport
+        size_t memory_usage() const {
+            return async::detail::tls_base<Transport>::memory_usage()
+                + sizeof(br_ssl_client_context)
+                + (xc ? sizeof(br_x509_minimal_context) : 0);
+        }
+
     private:
         // All these must be heap-allocated for move ctors to work,
         // because bearssl expects invariant addresses.
         std::unique_ptr<br_ssl_client_context> cc;
         std::unique_ptr<br_x509_minimal_context> xc;
-        std::vector<uint8_t> iobuf;
+    };
+}
 
+namespace async::tls::detail {
+    // Key type (BR_KEYTYPE_RSA or BR_KEYTYPE_EC) the certificate was signed with
+    inline unsigned signer_key_type(std::string_view raw_cert) {
+        auto dc = std::make_unique<br_x509_decoder_context>();
+        br_x509_decoder_init(dc.get(), [] (void*, const void*, size_t) {}, nullptr);
+        br_x509_decoder_push(dc.get(), raw_cert.data(), raw_cert.size());
+        if (br_x509_decoder_get_pkey(dc.get()) == nullptr) {
+            throw ex::runtime("certificate decoding failed", br_x509_decoder_last_error(dc.get()));
+        }
+        return br_x509_decoder_get_signer_key_type(dc.get());
+    }
+}
+
+namespace async::tls::detail {
+    // br_ssl_session_cache_lru behind a mutex,
+    // handshakes of one server_config may run on several threads
+    struct locked_session_cache {
+        explicit locked_session_cache(size_t size);
+        locked_session_cache(const locked_session_cache&) = delete;
+
+        // Must stay the first member, bearssl passes a pointer to it as the context
+        const br_ssl_session_cache_class* vtable;
+        std::vector<unsigned char> store;
+        br_ssl_session_cache_lru lru;
+        std::mutex mutex;
+    };
+
+    inline const br_ssl_session_cache_class locked_session_cache_vtable = {
+        .context_size = sizeof(locked_session_cache),
+        .save = [] (const br_ssl_session_cache_class** ctx, br_ssl_server_context* sc, const br_ssl_session_parameters* params) {
+            auto* self = reinterpret_cast<locked_session_cache*>(ctx);
+            std::lock_guard lock(self->mutex);
+            self->lru.vtable->save(&self->lru.vtable, sc, params);
+        },
+        .load = [] (const br_ssl_session_cache_class** ctx, br_ssl_server_context* sc, br_ssl_session_parameters* params) {
+            auto* self = reinterpret_cast<locked_session_cache*>(ctx);
+            std::lock_guard lock(self->mutex);
+            return self->lru.vtable->load(&self->lru.vtable, sc, params);
+        },
+    };
+
+    inline locked_session_cache::locked_session_cache(size_t size)
+        : vtable(&locked_session_cache_vtable)
+        , store(size)
+    {
+        br_ssl_session_cache_lru_init(&lru, store.data(), store.size());
+    }
+}
+
+namespace async::tls {
+    // Certificate chain and private key for a TLS server
+    class credentials {
     public:
-        Transport transport;
+        // chain_pem holds the server certificate first, followed by intermediates.
+        // key_pem holds an RSA or EC private key.
+        [[nodiscard]]
+        static credentials from_pem(std::string_view chain_pem, std::string_view key_pem) {
+            credentials ret;
+            ret.chain_data = pem::parse_certs(chain_pem);
+            if (ret.chain_data.empty()) {
+                throw ex::runtime("no certificates in certificate chain");
+            }
+            for (auto& cert : ret.chain_data) {
+                ret.chain.push_back({
+                    .data = reinterpret_cast<unsigned char*>(cert.data()),
+                    .data_len = cert.size(),
+                });
+            }
+            ret.issuer_key_type = detail::signer_key_type(ret.chain_data[0]);
+
+            ret.key = std::make_unique<br_skey_decoder_context>();
+            bool found = false;
+            for (const auto& obj : pem::parse_all(key_pem)) {
+                if (obj.label != "PRIVATE KEY" && obj.label != "RSA PRIVATE KEY" && obj.label != "EC PRIVATE KEY") {
+                    continue;
+                }
+                br_skey_decoder_init(ret.key.get());
+                br_skey_decoder_push(ret.key.get(), obj.data.data(), obj.data.size());
+                if (int err = br_skey_decoder_last_error(ret.key.get()); err != 0) {
+                    throw ex::runtime("private key decoding failed", err);
+                }
+                found = true;
+                break;
+            }
+            if (!found) {
+                throw ex::runtime("no private key in PEM data");
+            }
+            return ret;
+        }
+
+        // BR_KEYTYPE_RSA or BR_KEYTYPE_EC
+        int key_type() const { return br_skey_decoder_key_type(key.get()); }
+
+        void init_server(br_ssl_server_context* sc) const {
+            if (key_type() == BR_KEYTYPE_RSA) {
+                br_ssl_server_init_full_rsa(sc, chain.data(), chain.size(), br_skey_decoder_get_rsa(key.get()));
+            } else {
+                br_ssl_server_init_full_ec(sc, chain.data(), chain.size(), issuer_key_type, br_skey_decoder_get_ec(key.get()));
+            }
+        }
+
+        // Replaces the policy of an initialized server context
+        void set_policy(br_ssl_server_context* sc) const {
+            constexpr unsigned usages = BR_KEYTYPE_KEYX | BR_KEYTYPE_SIGN;
+            if (key_type() == BR_KEYTYPE_RSA) {
+                br_ssl_server_set_single_rsa(sc, chain.data(), chain.size(), br_skey_decoder_get_rsa(key.get()),
+                    usages, br_rsa_private_get_default(), br_rsa_pkcs1_sign_get_default());
+            } else {
+                br_ssl_server_set_single_ec(sc, chain.data(), chain.size(), br_skey_decoder_get_ec(key.get()),
+                    usages, issuer_key_type, br_ec_get_default(), br_ecdsa_sign_asn1_get_default());
+            }
+        }
+
+    private:
+        credentials() = default;
+
+        std::vector<std::string> chain_data;
+        std::vector<br_x509_certificate> chain;
+        // Key data lives inside the decoder context
+        std::unique_ptr<br_skey_decoder_context> key;
+        unsigned issuer_key_type = 0;
+    };
+
+    // Shared by all connections accepted with it, must outlive them.
+    // Don't modify it while connections are open.
+    class server_config {
+    public:
+        explicit server_config(credentials default_credentials, size_t session_cache_bytes = 64 * 1024)
+            : default_creds(std::move(default_credentials))
+            , cache(std::make_unique<detail::locked_session_cache>(session_cache_bytes))
+        {}
+
+        // Clients asking for name via SNI get these credentials instead of the default ones.
+        // "*.example.com" matches any single label in front of example.com.
+        void add_sni(std::string_view name, credentials creds) {
+            if (creds.key_type() != default_creds.key_type()) {
+                throw ex::runtime("all server certificates must use the same key type");
+            }
+            std::string key {name};
+            for (auto& c : key) { c = tolower(c); }
+            sni_creds.insert_or_assign(std::move(key), std::move(creds));
+        }
+
+        const credentials& select(std::string_view server_name) const {
+            std::string name {server_name};
+            for (auto& c : name) { c = tolower(c); }
+            if (auto iter = sni_creds.find(name); iter != sni_creds.end()) {
+                return iter->second;
+            }
+            if (auto dot = name.find('.'); dot != name.npos) {
+                if (auto iter = sni_creds.find("*" + name.substr(dot)); iter != sni_creds.end()) {
+                    return iter->second;
+                }
+            }
+            return default_creds;
+        }
+
+        const credentials& default_credentials() const { return default_creds; }
+        bool has_sni() const { return !sni_creds.empty(); }
+        const br_ssl_session_cache_class** session_cache() { return &cache->vtable; }
+
+        // For connections accepted with this config.
+        // Clients don't have to honor max_fragment_len, keep it at 16384 for public servers.
+        buffer_options buffers;
+        cipher_profile profile = cipher_profile::full;
+        // Run handshake crypto (signing, key exchange) here instead of on the event loop thread
+        thread_pool* crypto_pool = nullptr;
+
+    private:
+        credentials default_creds;
+        std::unordered_map<std::string, credentials> sni_creds;
+        std::unique_ptr<detail::locked_session_cache> cache;
     };
 }
 
 namespace async::tls::detail {
+    // Picks credentials by the SNI name when the ClientHello arrives,
+    // then hands the handshake over to the single-certificate policy for them.
+    struct sni_policy {
+        static int choose(const br_ssl_server_policy_class** pctx, const br_ssl_server_context* cc, br_ssl_server_choices* choices) {
+            const auto* self = reinterpret_cast<const sni_policy*>(pctx);
+            auto* sc = const_cast<br_ssl_server_context*>(cc);
+            const char* name = br_ssl_engine_get_server_name(&sc->eng);
+            self->config->select(name ? name : "").set_policy(sc);
+            return (*sc->policy_vtable)->choose(sc->policy_vtable, cc, choices);
+        }
+        // Never called, the engine uses the policy installed by choose()
+        static uint32_t do_keyx(const br_ssl_server_policy_class**, unsigned char*, size_t*) { return 0; }
+        static size_t do_sign(const br_ssl_server_policy_class**, unsigned, unsigned char*, size_t, size_t) { return 0; }
+
+        static constexpr br_ssl_server_policy_class class_vtable = {
+            .context_size = sizeof(br_ssl_server_policy_class*),
+            .choose = choose,
+            .do_keyx = do_keyx,
+            .do_sign = do_sign,
+        };
+
+        const br_ssl_server_policy_class* vtable = &class_vtable;
+        const server_config* config;
+    };
+}
+
+namespace async::transport {
+    template <typename Transport>
+    class tls_server : public async::detail::tls_base<Transport> {
+    public:
+        explicit tls_server(tls::server_config& config, Transport transport)
+            : async::detail::tls_base<Transport>(std::move(transport))
+        {
+            sc = std::make_unique<br_ssl_server_context>();
+            this->eng = &sc->eng;
+            config.default_credentials().init_server(sc.get());
+            br_ssl_engine_set_versions(&sc->eng, BR_TLS12, BR_TLS12);
+            tls::detail::apply_profile(&sc->eng, config.profile);
+            this->init_buffers(config.buffers);
+            this->crypto_pool = config.crypto_pool;
+            // The SNI policy only runs for the first handshake
+            br_ssl_engine_add_flags(&sc->eng, BR_OPT_NO_RENEGOTIATION);
+            if (config.has_sni()) {
+                policy = std::make_unique<tls::detail::sni_policy>();
+                policy->config = &config;
+                br_ssl_server_set_policy(sc.get(), &policy->vtable);
+            }
+            br_ssl_server_set_cache(sc.get(), config.session_cache());
+            br_ssl_server_reset(sc.get());
+        }
+        tls_server(const tls_server&) = delete;
+        tls_server(tls_server&&) = default;
+
+        // SNI name sent by the client, empty if none
+        std::string_view server_name() const {
+            const char* name = br_ssl_engine_get_server_name(&sc->eng);
+            return name ? name : "";
+        }
+
+        // Heap memory held by this connection, excluding the transport
+        size_t memory_usage() const {
+            return async::detail::tls_base<Transport>::memory_usage()
+                + sizeof(br_ssl_server_context)
+                + (policy ? sizeof(tls::detail::sni_policy) : 0);
+        }
+
+    private:
+        // Heap-allocated for invariant addresses, see tls_client
+        std::unique_ptr<br_ssl_server_context> sc;
+        std::unique_ptr<tls::detail::sni_policy> policy;
+    };
+}
+
+namespace async::tls {
+    struct session_cache_stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t expired = 0;
+        size_t evicted = 0;
+        size_t resumed = 0;    // hits the server accepted
+    };
+
+    // Client session parameters keyed by (host, port), safe to share between threads.
+    // Lets connect() do abbreviated handshakes to servers it has talked to recently.
+    class session_cache {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        explicit session_cache(size_t capacity = 1024, double ttl_s = 600)
+            : capacity(capacity)
+            , ttl(std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(ttl_s)))
+        {}
+
+        std::optional<br_ssl_session_parameters> get(std::string_view host, uint16_t port) {
+            const std::string k = key(host, port);
+            std::lock_guard lock {mutex};
+            auto iter = index.find(k);
+            if (iter == index.end()) {
+                stats_.misses++;
+                return std::nullopt;
+            }
+            if (iter->second->expires <= clock::now()) {
+                lru.erase(iter->second);
+                index.erase(iter);
+                stats_.expired++;
+                stats_.misses++;
+                return std::nullopt;
+            }
+            lru.splice(lru.begin(), lru, iter->second);
+            stats_.hits++;
+            return iter->second->params;
+        }
+
+        void put(std::string_view host, uint16_t port, const br_ssl_session_parameters& params) {
+            // Sessions without an id can't be resumed
+            if (params.session_id_len == 0 || capacity == 0) { return; }
+            std::string k = key(host, port);
+            std::lock_guard lock {mutex};
+            auto expires = clock::now() + ttl;
+            if (auto iter = index.find(k); iter != index.end()) {
+                // A resumed session keeps the expiry of the full handshake that created it
+                if (same_session(iter->second->params, params)) {
+                    expires = iter->second->expires;
+                }
+                lru.erase(iter->second);
+                index.erase(iter);
+            }
+            lru.push_front({k, params, expires});
+            index.emplace(std::move(k), lru.begin());
+            while (lru.size() > capacity) {
+                index.erase(lru.back().key);
+                lru.pop_back();
+                stats_.evicted++;
+            }
+        }
+
+        void count_resumed() {
+            std::lock_guard lock {mutex};
+            stats_.resumed++;
+        }
+
+        session_cache_stats stats() const {
+            std::lock_guard lock {mutex};
+            return stats_;
+        }
+
+        static bool same_session(const br_ssl_session_parameters& a, const br_ssl_session_parameters& b) {
+            return a.session_id_len == b.session_id_len && memcmp(a.session_id, b.session_id, a.session_id_len) == 0;
+        }
+
+    private:
+        // Host names are case-insensitive
+        static std::string key(std::string_view host, uint16_t port) {
+            std::string ret = fmt_raw(host, ':', port);
+            for (auto& c : ret) { c = tolower(c); }
+            return ret;
+        }
+
+        struct entry {
+            std::string key;
+            br_ssl_session_parameters params;
+            clock::time_point expires;
+        };
+
+        const size_t capacity;
+        const clock::duration ttl;
+        mutable std::mutex mutex;
+        std::list<entry> lru; // Most recently used first
+        std::unordered_map<std::string, std::list<entry>::iterator> index;
+        session_cache_stats stats_;
+    };
+
+    // Used by connect()
+    inline session_cache& default_session_cache() {
+        static session_cache cache;
+        return cache;
+    }
+}
+
+namespace async::tls::detail {
+    // Owns what a trust anchor points to. The decoder context is freed after decoding,
+    // so the key is copied out of it. Vectors keep their data in place when moved.
     struct ta_extra_data {
-        std::unique_ptr<br_x509_decoder_context> dc;
-        std::basic_string<uint8_t> dn;
+        std::vector<uint8_t> dn;
+        std::vector<uint8_t> key1; // RSA modulus or EC point
+        std::vector<uint8_t> key2; // RSA exponent
     };
 
     struct ta_list {
@@ -220,28 +832,36 @@ namespace async::tls::detail {
 
     inline void cert2ta(std::string_view raw_cert, ta_list& out) {
         static constexpr auto callback = [] (void *ctx, const void *buf, size_t len) {
-            using bstr = std::basic_string<uint8_t>;
-            bstr& dn = *reinterpret_cast<bstr*>(ctx);
-            dn.append(reinterpret_cast<const bstr::value_type*>(buf), len);
+            auto& dn = *reinterpret_cast<std::vector<uint8_t>*>(ctx);
+            dn.insert(dn.end(), static_cast<const uint8_t*>(buf), static_cast<const uint8_t*>(buf) + len);
         };
         ta_extra_data ed;
-        ed.dc = std::make_unique<br_x509_decoder_context>();
-	    br_x509_decoder_init(ed.dc.get(), callback, &ed.dn);
-	    br_x509_decoder_push(ed.dc.get(), raw_cert.data(), raw_cert.size());
-	    br_x509_pkey* pk = br_x509_decoder_get_pkey(ed.dc.get());
-	    if (pk == nullptr) {
-		    throw ex::runtime("certificate decoding failed", br_x509_decoder_last_error(ed.dc.get()));
-	    }
-	    br_x509_trust_anchor ta = {
-            .dn = {
-                .data = reinterpret_cast<uint8_t*>(ed.dn.data()),
-                .len = ed.dn.size(),
-            },
-            .flags = br_x509_decoder_isCA(ed.dc.get()) ? BR_X509_TA_CA : 0u,
+        auto dc = std::make_unique<br_x509_decoder_context>();
+        br_x509_decoder_init(dc.get(), callback, &ed.dn);
+        br_x509_decoder_push(dc.get(), raw_cert.data(), raw_cert.size());
+        const br_x509_pkey* pk = br_x509_decoder_get_pkey(dc.get());
+        if (pk == nullptr) {
+            throw ex::runtime("certificate decoding failed", br_x509_decoder_last_error(dc.get()));
+        }
+        br_x509_trust_anchor ta = {
+            .dn = {},
+            .flags = br_x509_decoder_isCA(dc.get()) ? BR_X509_TA_CA : 0u,
             .pkey = *pk,
         };
+        if (pk->key_type == BR_KEYTYPE_RSA) {
+            ed.key1.assign(pk->key.rsa.n, pk->key.rsa.n + pk->key.rsa.nlen);
+            ed.key2.assign(pk->key.rsa.e, pk->key.rsa.e + pk->key.rsa.elen);
+            ta.pkey.key.rsa.n = ed.key1.data();
+            ta.pkey.key.rsa.e = ed.key2.data();
+        } else if (pk->key_type == BR_KEYTYPE_EC) {
+            ed.key1.assign(pk->key.ec.q, pk->key.ec.q + pk->key.ec.qlen);
+            ta.pkey.key.ec.q = ed.key1.data();
+        } else {
+            throw ex::runtime("unsupported trust anchor key type", pk->key_type);
+        }
+        ta.dn = {.data = ed.dn.data(), .len = ed.dn.size()};
         out.eds.push_back(std::move(ed));
-        out.tas.push_back(std::move(ta));
+        out.tas.push_back(ta);
     }
 
     [[nodiscard]]
@@ -286,10 +906,36 @@ namespace async::tls {
 }
 
 namespace async::tls::detail {
-    inline task<const ta_list*> get_default_ta_list() {
-        // TODO UB when pem_to_ta_list throws
-        static const ta_list l = detail::pem_to_ta_list(co_await get_default_certs());
-        co_return &l;
+    // A store generated by ta_compile when ASYNC2_TRUST_STORE points to one or the build
+    // installed one, otherwise the decoded default certificates, used as they are
+    using default_anchor_source = std::variant<trust_store, ta_list>;
+
+    [[nodiscard]]
+    inline default_anchor_source load_default_anchors() {
+        if (const char* path = getenv("ASYNC2_TRUST_STORE"); path && *path) {
+            return trust_store::from_file(path);
+        }
+#ifdef ASYNC2_DEFAULT_TRUST_STORE
+        if (std::filesystem::exists(ASYNC2_DEFAULT_TRUST_STORE)) {
+            try {
+                return trust_store::from_file(ASYNC2_DEFAULT_TRUST_STORE);
+            } catch (const std::exception&) {
+                // From an older version, the certificates are still there
+            }
+        }
+#endif
+        const auto pem = c_api::mmap_file(detail::default_certs_path());
+        return detail::pem_to_ta_list(pem.view());
+    }
+
+    // Loaded without suspending, so the static can't be initialized
+    // by two coroutines at once. Retried on the next call if loading throws.
+    inline std::span<const br_x509_trust_anchor> default_trust_anchors() {
+        static const default_anchor_source source = load_default_anchors();
+        if (const auto* store = std::get_if<trust_store>(&source)) {
+            return store->anchors();
+        }
+        return std::get<ta_list>(source).tas;
     }
 }
 
@@ -299,20 +945,52 @@ namespace async::tls {
     // end with "-----END CERTIFICATE-----",
     // and can be separated with any amount of lines (with or without text).
     // Default certificates end with a newline.
+    // Sessions are resumed through options.sessions, or default_session_cache() when using
+    // default certificates. Resumed sessions skip certificate validation, so connections
+    // with custom certificates don't share the default cache.
     inline task<transport::tls_client<transport::tcp_socket>> connect(
         std::string_view host,
         uint16_t port,
-        std::optional<std::string_view> certs = std::nullopt
+        std::optional<std::string_view> certs = std::nullopt,
+        const client_options& options = {}
     ) {
-        const detail::ta_list* list_ptr;
+        std::span<const br_x509_trust_anchor> tas;
         std::optional<detail::ta_list> certs_list;
+        session_cache* sessions = options.sessions;
         if (certs) {
             certs_list = detail::pem_to_ta_list(*certs);
-            list_ptr = &certs_list.value();
+            tas = certs_list->tas;
         } else {
-            list_ptr = co_await detail::get_default_ta_list();
+            tas = detail::default_trust_anchors();
+            if (!sessions) {
+                sessions = &default_session_cache();
+            }
+        }
+        std::optional<br_ssl_session_parameters> cached;
+        if (sessions) {
+            cached = sessions->get(host, port);
+        }
+        transport::tls_client ret {host, tas, co_await tcp::connect(host, port), cached ? &*cached : nullptr, options};
+        co_await ret.wait_write(); // Complete the handshake
+        if (options.release_x509) {
+            ret.release_x509();
+        }
+        if (sessions) {
+            const auto params = ret.session_parameters();
+            if (cached && session_cache::same_session(*cached, params)) {
+                sessions->count_resumed();
+            }
+            sessions->put(host, port, params);
         }
-        transport::tls_client ret {host, list_ptr->tas, co_await tcp::connect(host, port)};
+        co_return ret;
+    }
+}
+
+namespace async::tls {
+    // Completes the server side of the handshake on an accepted connection
+    template <typename Transport>
+    task<transport::tls_server<Transport>> accept(Transport transport, server_config& config) {
+        transport::tls_server<Transport> ret {config, std::move(transport)};
         co_await ret.wait_write(); // Complete the handshake
         co_return ret;
     }
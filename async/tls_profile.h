@@ -0,0 +1,163 @@
+#pragma once
+#include <bearssl.h>
+#include <ex.h>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace async::tls {
+    enum class cipher_profile {
+        // Everything br_ssl_*_init_full enables, implementations picked by BearSSL
+        full,
+        // ECDHE with AES-GCM on AES-NI/PCLMUL, 64-bit P-256 and X25519 engines
+        fast_x86,
+        // Constant-time code without CPU extensions, ChaCha20-Poly1305 preferred
+        portable,
+        // fast_x86 if the CPU supports it, portable otherwise
+        automatic,
+    };
+
+    inline std::string_view name(cipher_profile profile) {
+        switch (profile) {
+            case cipher_profile::full: return "full";
+            case cipher_profile::fast_x86: return "fast-x86";
+            case cipher_profile::portable: return "portable";
+            case cipher_profile::automatic: return "automatic";
+        }
+        return "unknown";
+    }
+
+    // What a profile installs into the engine
+    struct cipher_impls {
+        std::span<const uint16_t> suites;
+        const br_block_ctr_class* aes_ctr;
+        br_ghash ghash;
+        br_chacha20_run chacha20;
+        br_poly1305_run poly1305;
+        const br_ec_impl* ec;
+        br_ecdsa_vrfy ecdsa_vrfy;
+    };
+}
+
+namespace async::tls::detail {
+    // Forward-secret AEAD suites only, in order of preference
+    inline constexpr uint16_t aes_first_suites[] = {
+        BR_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+        BR_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+        BR_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+        BR_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+        BR_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+        BR_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+    };
+    inline constexpr uint16_t chacha_first_suites[] = {
+        BR_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+        BR_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+        BR_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+        BR_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+        BR_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+        BR_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    };
+
+    // BearSSL has no combined 64-bit EC implementation,
+    // this one sends P-256 and X25519 to the m64 engines and the rest to all_m31
+    inline const br_ec_impl& ec_m64_for(int curve) {
+        static const br_ec_impl* const p256 = br_ec_p256_m64_get();
+        static const br_ec_impl* const c25519 = br_ec_c25519_m64_get();
+        if (curve == BR_EC_secp256r1 && p256) { return *p256; }
+        if (curve == BR_EC_curve25519 && c25519) { return *c25519; }
+        return br_ec_all_m31;
+    }
+
+    inline const br_ec_impl ec_all_m64 = {
+        .supported_curves = (uint32_t(1) << BR_EC_secp256r1) | (uint32_t(1) << BR_EC_secp384r1)
+            | (uint32_t(1) << BR_EC_secp521r1) | (uint32_t(1) << BR_EC_curve25519),
+        .generator = [] (int curve, size_t* len) {
+            return ec_m64_for(curve).generator(curve, len);
+        },
+        .order = [] (int curve, size_t* len) {
+            return ec_m64_for(curve).order(curve, len);
+        },
+        .xoff = [] (int curve, size_t* len) {
+            return ec_m64_for(curve).xoff(curve, len);
+        },
+        .mul = [] (unsigned char* G, size_t Glen, const unsigned char* x, size_t xlen, int curve) {
+            return ec_m64_for(curve).mul(G, Glen, x, xlen, curve);
+        },
+        .mulgen = [] (unsigned char* R, const unsigned char* x, size_t xlen, int curve) {
+            return ec_m64_for(curve).mulgen(R, x, xlen, curve);
+        },
+        .muladd = [] (unsigned char* A, const unsigned char* B, size_t len,
+                      const unsigned char* x, size_t xlen, const unsigned char* y, size_t ylen, int curve) {
+            return ec_m64_for(curve).muladd(A, B, len, x, xlen, y, ylen, curve);
+        },
+    };
+
+    // nullopt if the CPU lacks AES-NI or PCLMUL
+    inline std::optional<cipher_impls> fast_x86_impls() {
+        const br_block_ctr_class* aes = br_aes_x86ni_ctr_get_vtable();
+        br_ghash ghash = br_ghash_pclmul_get();
+        if (!aes || !ghash) { return std::nullopt; }
+        br_chacha20_run chacha = br_chacha20_sse2_get();
+        br_poly1305_run poly = br_poly1305_ctmulq_get();
+        return cipher_impls {
+            .suites = aes_first_suites,
+            .aes_ctr = aes,
+            .ghash = ghash,
+            .chacha20 = chacha ? chacha : &br_chacha20_ct_run,
+            .poly1305 = poly ? poly : &br_poly1305_ctmul_run,
+            .ec = &ec_all_m64,
+            .ecdsa_vrfy = &br_ecdsa_i31_vrfy_asn1,
+        };
+    }
+
+    inline cipher_impls portable_impls() {
+        return {
+            .suites = chacha_first_suites,
+            .aes_ctr = &br_aes_ct64_ctr_vtable,
+            .ghash = &br_ghash_ctmul64,
+            .chacha20 = &br_chacha20_ct_run,
+            .poly1305 = &br_poly1305_ctmul_run,
+            .ec = &br_ec_all_m31,
+            .ecdsa_vrfy = &br_ecdsa_i31_vrfy_asn1,
+        };
+    }
+}
+
+namespace async::tls {
+    // Implementations a profile installs. nullopt for full, which keeps BearSSL's choices,
+    // and for fast_x86 on CPUs without AES-NI/PCLMUL.
+    inline std::optional<cipher_impls> implementations(cipher_profile profile) {
+        switch (profile) {
+            case cipher_profile::full: return std::nullopt;
+            case cipher_profile::fast_x86: return detail::fast_x86_impls();
+            case cipher_profile::portable: return detail::portable_impls();
+            case cipher_profile::automatic: {
+                // CPU features don't change, detect them once
+                static const cipher_impls impls = detail::fast_x86_impls().value_or(detail::portable_impls());
+                return impls;
+            }
+        }
+        return std::nullopt;
+    }
+}
+
+namespace async::tls::detail {
+    // Call after br_ssl_*_init_full, returns the installed implementations
+    inline std::optional<cipher_impls> apply_profile(br_ssl_engine_context* eng, cipher_profile profile) {
+        if (profile == cipher_profile::full) { return std::nullopt; }
+        auto impls = implementations(profile);
+        if (!impls) {
+            throw ex::runtime(fmt("cipher profile not supported by this cpu:", name(profile)));
+        }
+        br_ssl_engine_set_suites(eng, impls->suites.data(), impls->suites.size());
+        br_ssl_engine_set_aes_ctr(eng, impls->aes_ctr);
+        br_ssl_engine_set_ghash(eng, impls->ghash);
+        br_ssl_engine_set_gcm(eng, &br_sslrec_in_gcm_vtable, &br_sslrec_out_gcm_vtable);
+        br_ssl_engine_set_chacha20(eng, impls->chacha20);
+        br_ssl_engine_set_poly1305(eng, impls->poly1305);
+        br_ssl_engine_set_chapol(eng, &br_sslrec_in_chapol_vtable, &br_sslrec_out_chapol_vtable);
+        br_ssl_engine_set_ec(eng, impls->ec);
+        br_ssl_engine_set_ecdsa(eng, impls->ecdsa_vrfy);
+        return impls;
+    }
+}
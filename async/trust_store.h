@@ -0,0 +1,210 @@
+#pragma once
+#include "posix_wrappers.h"
+#include <bearssl.h>
+#include <algorithm>
+#include <span>
+#include <variant>
+#include <vector>
+
+// Serialized trust anchors that can be used straight from a memory mapping.
+//
+// Layout (native byte order, all offsets relative to the start of the file):
+//   header
+//   record[count], sorted by dn_hash
+//   blob with DNs and key data
+namespace async::tls::detail::trust_store_format {
+    inline constexpr char magic[4] = {'B', 'R', 'T', 'A'};
+    inline constexpr uint32_t byte_order_mark = 0x01020304;
+    inline constexpr uint32_t version = 3;
+
+    struct header {
+        char magic[4];
+        uint32_t byte_order;
+        uint32_t version;
+        uint32_t count;
+    };
+
+    struct record {
+        uint64_t dn_hash;
+        uint32_t dn_off, dn_len;
+        uint32_t flags;
+        uint32_t key_type;      // BR_KEYTYPE_RSA or BR_KEYTYPE_EC
+        uint32_t key1_off, key1_len; // RSA modulus or EC point
+        uint32_t key2_off, key2_len; // RSA exponent, unused for EC
+        uint32_t curve;         // EC curve id, unused for RSA
+        uint32_t reserved;
+    };
+
+    // FNV-1a
+    inline uint64_t dn_hash(std::span<const unsigned char> dn) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (unsigned char c : dn) {
+            h ^= c;
+            h *= 0x100000001b3ull;
+        }
+        return h;
+    }
+}
+
+namespace async::tls {
+    // Read-only after construction, safe to share between threads
+    class trust_store {
+    public:
+        // Maps the file produced by serialize(), nothing is copied or decoded
+        [[nodiscard]]
+        static trust_store from_file(std::string_view path) {
+            return trust_store(c_api::mmap_file(path));
+        }
+        [[nodiscard]]
+        static trust_store from_bytes(std::string_view data) {
+            return trust_store(std::vector<char>(data.begin(), data.end()));
+        }
+
+        [[nodiscard]]
+        static std::string serialize(std::span<const br_x509_trust_anchor> tas) {
+            using namespace detail::trust_store_format;
+            std::vector<record> records;
+            std::string blob;
+            const size_t blob_start = sizeof(header) + tas.size() * sizeof(record);
+            const auto append = [&] (const unsigned char* data, size_t len) {
+                const size_t off = blob_start + blob.size();
+                blob.append(reinterpret_cast<const char*>(data), len);
+                return static_cast<uint32_t>(off);
+            };
+            for (const auto& ta : tas) {
+                record r = {};
+                r.dn_hash = dn_hash({ta.dn.data, ta.dn.len});
+                r.dn_len = ta.dn.len;
+                r.dn_off = append(ta.dn.data, ta.dn.len);
+                r.flags = ta.flags;
+                r.key_type = ta.pkey.key_type;
+                if (ta.pkey.key_type == BR_KEYTYPE_RSA) {
+                    const auto& k = ta.pkey.key.rsa;
+                    r.key1_len = k.nlen;
+                    r.key1_off = append(k.n, k.nlen);
+                    r.key2_len = k.elen;
+                    r.key2_off = append(k.e, k.elen);
+                } else if (ta.pkey.key_type == BR_KEYTYPE_EC) {
+                    const auto& k = ta.pkey.key.ec;
+                    r.key1_len = k.qlen;
+                    r.key1_off = append(k.q, k.qlen);
+                    r.curve = k.curve;
+                } else {
+                    throw ex::runtime("unsupported trust anchor key type", ta.pkey.key_type);
+                }
+                records.push_back(r);
+            }
+            std::stable_sort(records.begin(), records.end(), [] (const record& a, const record& b) {
+                return a.dn_hash < b.dn_hash;
+            });
+            header h = {};
+            std::copy(std::begin(magic), std::end(magic), h.magic);
+            h.byte_order = byte_order_mark;
+            h.version = version;
+            h.count = records.size();
+            std::string ret;
+            ret.reserve(blob_start + blob.size());
+            ret.append(reinterpret_cast<const char*>(&h), sizeof(h));
+            ret.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(record));
+            ret.append(blob);
+            return ret;
+        }
+
+        std::span<const br_x509_trust_anchor> anchors() const { return tas; }
+        size_t size() const { return tas.size(); }
+
+        // Anchors with this DN. The records are the index, searched by DN hash
+        // without building anything at load time.
+        std::vector<const br_x509_trust_anchor*> find(std::span<const unsigned char> dn) const {
+            using namespace detail::trust_store_format;
+            const uint64_t h = dn_hash(dn);
+            auto recs = records();
+            auto iter = std::lower_bound(recs.begin(), recs.end(), h, [] (const record& r, uint64_t h) {
+                return r.dn_hash < h;
+            });
+            std::vector<const br_x509_trust_anchor*> ret;
+            for (; iter != recs.end() && iter->dn_hash == h; ++iter) {
+                const auto& ta = tas[iter - recs.begin()];
+                if (std::ranges::equal(std::span<const unsigned char>(ta.dn.data, ta.dn.len), dn)) {
+                    ret.push_back(&ta);
+                }
+            }
+            return ret;
+        }
+
+    private:
+        // Neither keeps its data inline, so moving a store doesn't invalidate tas
+        using storage_t = std::variant<c_api::mapping, std::vector<char>>;
+
+        explicit trust_store(storage_t s) : storage(std::move(s)) {
+            using namespace detail::trust_store_format;
+            const std::string_view data = bytes();
+            const auto fail = [] { throw ex::runtime("malformed trust store"); };
+            if (data.size() < sizeof(header)) { fail(); }
+            header h;
+            memcpy(&h, data.data(), sizeof(h));
+            if (!std::equal(std::begin(magic), std::end(magic), h.magic)) { fail(); }
+            if (h.byte_order != byte_order_mark) {
+                throw ex::runtime("trust store was generated on a machine with a different byte order");
+            }
+            if (h.version != version) {
+                throw ex::runtime("unsupported trust store version", h.version);
+            }
+            if (h.count > (data.size() - sizeof(header)) / sizeof(record)) { fail(); }
+            auto* base = reinterpret_cast<unsigned char*>(const_cast<char*>(data.data()));
+            const auto field = [&] (uint32_t off, uint32_t len) {
+                if (off > data.size() || len > data.size() - off) { fail(); }
+                return base + off;
+            };
+            tas.reserve(h.count);
+            for (const record& r : records()) {
+                br_x509_trust_anchor ta = {
+                    .dn = {
+                        .data = field(r.dn_off, r.dn_len),
+                        .len = r.dn_len,
+                    },
+                    .flags = r.flags,
+                    .pkey = {},
+                };
+                ta.pkey.key_type = r.key_type;
+                if (r.key_type == BR_KEYTYPE_RSA) {
+                    ta.pkey.key.rsa = {
+                        .n = field(r.key1_off, r.key1_len),
+                        .nlen = r.key1_len,
+                        .e = field(r.key2_off, r.key2_len),
+                        .elen = r.key2_len,
+                    };
+                } else if (r.key_type == BR_KEYTYPE_EC) {
+                    ta.pkey.key.ec = {
+                        .curve = static_cast<int>(r.curve),
+                        .q = field(r.key1_off, r.key1_len),
+                        .qlen = r.key1_len,
+                    };
+                } else {
+                    fail();
+                }
+                tas.push_back(ta);
+            }
+        }
+
+        std::string_view bytes() const {
+            if (auto* m = std::get_if<c_api::mapping>(&storage)) {
+                return m->view();
+            }
+            const auto& v = std::get<std::vector<char>>(storage);
+            return {v.data(), v.size()};
+        }
+
+        // Records are suitably aligned, mappings are page-aligned and vectors are new-aligned
+        std::span<const detail::trust_store_format::record> records() const {
+            using namespace detail::trust_store_format;
+            const std::string_view data = bytes();
+            const auto* h = reinterpret_cast<const header*>(data.data());
+            return {reinterpret_cast<const record*>(data.data() + sizeof(header)), h->count};
+        }
+
+        storage_t storage;
+        // Point into storage
+        std::vector<br_x509_trust_anchor> tas;
+    };
+}
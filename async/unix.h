@@ -0,0 +1,153 @@
+#pragma once
+#include "stream.h"
+#include "socket.h"
+
+namespace async::uds {
+    // What recv_fds() returns besides the data
+    struct received_fds {
+        std::vector<c_api::fd> fds;
+        // The sender attached more fds than fit, the kernel closed the rest
+        bool truncated = false;
+    };
+}
+
+namespace async::transport {
+    // SOCK_STREAM unix domain socket
+    class unix_socket {
+    public:
+        explicit unix_socket(c_api::fd fd_handle) : fd_handle(std::move(fd_handle)) {}
+
+        task<void> wait_read() { co_await poll_loop.wait_read(fd_handle); }
+        task<void> wait_write() { co_await poll_loop.wait_write(fd_handle); }
+        size_t read(void* buf, size_t size) { return c_api::read(fd_handle, buf, size); }
+        size_t write(std::string_view data) { return c_api::write(fd_handle, data); }
+
+        // fds are attached to the first byte of data, so data must not be empty.
+        // Received fds are only returned by recv_fds(), a plain read() discards them.
+        task<void> send_fds(std::span<const int> fds, std::string_view data = std::string_view("\0", 1)) {
+            assert(!data.empty());
+            size_t n_sent = c_api::sendmsg_fds(fd_handle, data, fds);
+            while (n_sent == 0) {
+                co_await wait_write();
+                n_sent = c_api::sendmsg_fds(fd_handle, data, fds);
+            }
+            data = data.substr(n_sent);
+            while (!data.empty()) {
+                co_await wait_write();
+                data = data.substr(write(data));
+            }
+        }
+        // Reads at least one byte into out, returns fds received along with it.
+        // Received fds keep the blocking mode the sender gave them.
+        task<uds::received_fds> recv_fds(std::string& out, size_t max_size = 1) {
+            uds::received_fds ret;
+            out.resize(out.size() + max_size);
+            size_t n_read = 0;
+            while (n_read == 0) {
+                co_await wait_read();
+                n_read = c_api::recvmsg_fds(fd_handle, out.data() + out.size() - max_size, max_size,
+                                            ret.fds, ret.truncated);
+            }
+            out.resize(out.size() - max_size + n_read);
+            co_return ret;
+        }
+
+        task<void> flush() { co_return; }
+        task<void> close() { c_api::close(fd_handle); co_return; }
+
+        static constexpr bool has_lookahead = true;
+        size_t available_bytes() { return c_api::available_bytes(fd_handle); }
+
+        c_api::fd fd_handle;
+    };
+}
+
+namespace async::msg_transport {
+    // SOCK_SEQPACKET unix domain socket, preserves message boundaries
+    class unix_seqpacket_socket {
+    public:
+        explicit unix_seqpacket_socket(c_api::fd fd_handle) : fd_handle(std::move(fd_handle)) {}
+
+        static constexpr size_t max_incoming_packet_size = 65536;
+        static constexpr size_t max_outgoing_packet_size = 65536;
+
+        task<void> wait_read() { co_await poll_loop.wait_read(fd_handle); }
+        task<void> wait_write() { co_await poll_loop.wait_write(fd_handle); }
+        size_t read(void* buf, size_t size) { return c_api::read(fd_handle, buf, size); }
+        size_t write(std::string_view data) { return c_api::write(fd_handle, data); }
+
+        // Sends one message with fds attached, data must not be empty
+        task<void> send_fds(std::span<const int> fds, std::string_view data = std::string_view("\0", 1)) {
+            assert(!data.empty());
+            if (data.size() > max_outgoing_packet_size) {
+                throw ex::runtime("data size exceeds maximum packet size");
+            }
+            size_t n_sent = c_api::sendmsg_fds(fd_handle, data, fds);
+            while (n_sent == 0) {
+                co_await wait_write();
+                n_sent = c_api::sendmsg_fds(fd_handle, data, fds);
+            }
+            assert(n_sent == data.size());
+        }
+        // Reads one message into out, returns fds received along with it.
+        // Received fds keep the blocking mode the sender gave them.
+        task<uds::received_fds> recv_fds(std::string& out) {
+            uds::received_fds ret;
+            const size_t size = max_incoming_packet_size;
+            out.resize(out.size() + size);
+            size_t n_read = 0;
+            while (n_read == 0) {
+                co_await wait_read();
+                n_read = c_api::recvmsg_fds(fd_handle, out.data() + out.size() - size, size, ret.fds, ret.truncated);
+            }
+            out.resize(out.size() - size + n_read);
+            co_return ret;
+        }
+
+        task<void> close() { c_api::close(fd_handle); co_return; }
+
+        // FIONREAD counts the bytes of all queued messages, not the size of the next one
+        static constexpr bool has_lookahead = false;
+
+        c_api::fd fd_handle;
+    };
+}
+
+// Not named "unix", which is a predefined macro in GNU dialects
+namespace async::uds {
+    template <typename Socket>
+    class server {
+    public:
+        task<Socket> accept() {
+            while (true) {
+                co_await poll_loop.wait_read(server_fd);
+                c_api::fd fd = c_api::accept(server_fd);
+                if (fd) { co_return Socket(std::move(fd)); }
+            }
+        }
+        static server from_fd(c_api::fd fd) { return server{std::move(fd)}; }
+    private:
+        explicit server(c_api::fd fd) : server_fd(std::move(fd)) {}
+    private:
+        c_api::fd server_fd;
+    };
+
+    // Paths starting with '@' are in the abstract namespace
+    inline task<transport::unix_socket> connect(std::string_view path) {
+        c_api::fd fd = co_await async::detail::make_connected_unix_socket(path, SOCK_STREAM);
+        co_return transport::unix_socket(std::move(fd));
+    }
+
+    inline task<msg_transport::unix_seqpacket_socket> connect_seqpacket(std::string_view path) {
+        c_api::fd fd = co_await async::detail::make_connected_unix_socket(path, SOCK_SEQPACKET);
+        co_return msg_transport::unix_seqpacket_socket(std::move(fd));
+    }
+
+    inline task<server<transport::unix_socket>> listen(std::string_view path) {
+        co_return server<transport::unix_socket>::from_fd(c_api::bind_listen_unix(path, SOCK_STREAM));
+    }
+
+    inline task<server<msg_transport::unix_seqpacket_socket>> listen_seqpacket(std::string_view path) {
+        co_return server<msg_transport::unix_seqpacket_socket>::from_fd(c_api::bind_listen_unix(path, SOCK_SEQPACKET));
+    }
+}
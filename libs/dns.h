@@ -1,4 +1,7 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <optional>
 #include <random>
 #include <stdexcept>
 
@@ -21,6 +24,7 @@ namespace dns {
         uint16_t rtype;
         uint16_t rclass;
         uint32_t ttl;
+        // Names in NS, CNAME and PTR rdata are stored uncompressed, so it doesn't need the packet
         std::string rdata;
     };
 
@@ -75,7 +79,70 @@ namespace dns {
     };
 }
 
+namespace dns {
+    // https://www.rfc-editor.org/rfc/rfc1035#section-2.3.4
+    inline constexpr size_t max_name_size = 255;
+
+    // Decoded name in dotted form without the trailing dot
+    struct name_buffer {
+        std::array<char, max_name_size> data;
+        size_t size = 0;
+        std::string_view view() const { return {data.data(), size}; }
+    };
+}
+
 namespace dns::detail {
+    inline constexpr char ascii_lower(char c) {
+        return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+    // DNS names compare case-insensitively
+    inline bool iequal(std::string_view a, std::string_view b) {
+        return std::ranges::equal(a, b, [] (char x, char y) { return ascii_lower(x) == ascii_lower(y); });
+    }
+
+    // Decodes the name at pos, following compression pointers without recursion.
+    // Returns the offset just past the name where it starts (past the first pointer, if any).
+    inline size_t decode_name(std::string_view packet, size_t pos, name_buffer& out) {
+        out.size = 0;
+        size_t end = 0;
+        // Pointers must point before the labels read so far, which rules out loops
+        size_t limit = pos;
+        while (true) {
+            if (pos >= packet.size()) {
+                throw std::runtime_error("unexpected DNS response end");
+            }
+            const uint8_t len = packet[pos];
+            if ((len & 0b11000000u) == 0b11000000u) {
+                if (pos + 1 >= packet.size()) {
+                    throw std::runtime_error("unexpected DNS response end");
+                }
+                const size_t target = ((len & 0b00111111u) << 8) | static_cast<uint8_t>(packet[pos + 1]);
+                if (end == 0) { end = pos + 2; }
+                if (target >= limit) {
+                    throw std::runtime_error("invalid pointer in DNS response domain name");
+                }
+                pos = limit = target;
+                continue;
+            }
+            if ((len & 0b11000000u) != 0) {
+                throw std::runtime_error("unsupported label type in DNS response domain name");
+            }
+            pos++;
+            if (len == 0) { break; }
+            if (len > packet.size() - pos) {
+                throw std::runtime_error("unexpected DNS response end");
+            }
+            if (out.size + (out.size != 0) + len > max_name_size) {
+                throw std::runtime_error("record name too long in DNS response");
+            }
+            if (out.size != 0) { out.data[out.size++] = '.'; }
+            std::copy_n(packet.data() + pos, len, out.data.data() + out.size);
+            out.size += len;
+            pos += len;
+        }
+        return end != 0 ? end : pos;
+    }
+
     class serializer {
     public:
         void push_byte(uint8_t v) {
@@ -213,28 +280,23 @@ namespace dns::detail {
             return string(len);
         }
         [[nodiscard]]
-        std::string name(size_t level = 0) {
-            if (level > 16) {
-                throw std::runtime_error("recursion too deep in DNS response domain name");
-            }
-            std::string ret;
-            for (size_t iterations = 0; iterations < 32; iterations++) {
-                checklen(1);
-                if (str[0] == '\0') {
+        std::string name() {
+            name_buffer buf;
+            const size_t end = decode_name(full, current_index(), buf);
+            advance(end - current_index());
+            return std::string(buf.view());
+        }
+        // Skips a name without following compression pointers,
+        // works on rdata copied out of the packet
+        void skip_name() {
+            for (size_t iterations = 0; iterations < 128; iterations++) {
+                const uint8_t len = byte();
+                if (len == 0) { return; }
+                if ((len & 0b11000000u) == 0b11000000u) {
                     (void) byte();
-                    if (ret.ends_with('.')) { ret.pop_back(); }
-                    return ret;
-                } else if ((str[0] & 0b11000000u) == 0b11000000u) {
-                    uint16_t offset = word() & 0b00111111'11111111u;
-                    if (offset >= full.size()) {
-                        throw std::runtime_error("invalid pointer in DNS response domain name");
-                    }
-                    ret.append(parser(full.substr(offset)).name(level + 1));
-                    return ret;
-                } else {
-                    ret.append(label());
-                    ret.push_back('.');
+                    return;
                 }
+                (void) string(len & 0b00111111u);
             }
             throw std::runtime_error("record name too long in DNS response");
         }
@@ -248,13 +310,27 @@ namespace dns::detail {
         }
         [[nodiscard]]
         resource_record_t resource_record() {
-            return {
+            resource_record_t rr {
                 .rname = name(),
                 .rtype = word(),
                 .rclass = word(),
                 .ttl = dword(),
-                .rdata = std::string(string(word())),
+                .rdata = {},
             };
+            const uint16_t rdlength = word();
+            const size_t rdata_pos = current_index();
+            rr.rdata = std::string(string(rdlength));
+            // NS, CNAME and PTR targets may point into the rest of the packet
+            if (rr.rclass == 1 && (rr.rtype == 2 || rr.rtype == 5 || rr.rtype == 12)) {
+                name_buffer target;
+                if (decode_name(full, rdata_pos, target) != rdata_pos + rdlength) {
+                    throw std::runtime_error("invalid name in DNS record data");
+                }
+                serializer s;
+                s.push_name(target.view());
+                rr.rdata = std::move(s.buf);
+            }
+            return rr;
         }
         flags_t flags() {
             uint16_t w = word();
@@ -299,23 +375,281 @@ namespace dns::detail {
     };
 }
 
+// In-place access to packets, for hot paths that shouldn't allocate
+namespace dns {
+    enum class section_t : uint8_t {
+        question = 0,
+        answer = 1,
+        authority = 2,
+        additional = 3,
+    };
+
+    struct question_view {
+        size_t name_offset;
+        uint16_t qtype;
+        uint16_t qclass;
+    };
+
+    struct record_view {
+        section_t section;
+        size_t name_offset;
+        uint16_t rtype;
+        uint16_t rclass;
+        uint32_t ttl;
+        std::string_view rdata;
+        // Names in rdata may point into the rest of the packet, decode them from here
+        size_t rdata_offset;
+    };
+
+    // Walks a packet without copying it. The header is read up front,
+    // questions and records one at a time, names only when asked for.
+    // The packet must outlive the view.
+    class message_view {
+    public:
+        explicit message_view(std::string_view packet) : packet(packet) {
+            detail::parser p(packet);
+            id_ = p.word();
+            flags_ = p.flags();
+            for (auto& n : counts) { n = p.word(); }
+            pos = p.current_index();
+        }
+
+        uint16_t id() const { return id_; }
+        const flags_t& flags() const { return flags_; }
+        uint16_t count(section_t section) const { return counts[static_cast<size_t>(section)]; }
+        std::string_view bytes() const { return packet; }
+        // Where the next question or record starts
+        size_t offset() const { return pos; }
+
+        // False after the last question
+        [[nodiscard]]
+        bool next_question(question_view& q) {
+            if (questions_read == count(section_t::question)) { return false; }
+            detail::parser p(packet.substr(pos));
+            q.name_offset = pos;
+            p.skip_name();
+            q.qtype = p.word();
+            q.qclass = p.word();
+            pos += p.current_index();
+            questions_read++;
+            return true;
+        }
+
+        // Records of all sections in packet order, skipping questions not read yet.
+        // False after the last one.
+        [[nodiscard]]
+        bool next_record(record_view& rr) {
+            for (question_view q; next_question(q); ) {}
+            size_t index = records_read;
+            size_t section = 1;
+            while (section < counts.size() && index >= counts[section]) {
+                index -= counts[section];
+                section++;
+            }
+            if (section == counts.size()) { return false; }
+            detail::parser p(packet.substr(pos));
+            rr.section = static_cast<section_t>(section);
+            rr.name_offset = pos;
+            p.skip_name();
+            rr.rtype = p.word();
+            rr.rclass = p.word();
+            rr.ttl = p.dword();
+            const uint16_t rdlength = p.word();
+            rr.rdata_offset = pos + p.current_index();
+            rr.rdata = p.string(rdlength);
+            pos += p.current_index();
+            records_read++;
+            return true;
+        }
+
+        void name(size_t offset, name_buffer& out) const {
+            (void) detail::decode_name(packet, offset, out);
+        }
+        // Case-insensitive, name without the trailing dot
+        bool name_equals(size_t offset, std::string_view name) const {
+            name_buffer buf;
+            this->name(offset, buf);
+            return detail::iequal(buf.view(), name);
+        }
+
+    private:
+        std::string_view packet;
+        size_t pos;
+        uint16_t id_;
+        flags_t flags_;
+        // Indexed by section_t
+        std::array<uint16_t, 4> counts;
+        size_t questions_read = 0;
+        size_t records_read = 0;
+    };
+
+    // Appends a packet to a caller-owned buffer, reusing its capacity.
+    // Names are compressed against the names written before them.
+    // Questions and records must be added in section order.
+    class message_writer {
+    public:
+        message_writer(std::string& buf, uint16_t id, const flags_t& flags) : buf(buf) {
+            buf.clear();
+            push_word(id);
+            detail::serializer s;
+            s.push_flags(flags);
+            buf.append(s.buf);
+            buf.append(8, '\0');  // Counts, filled in as records are added
+        }
+
+        void question(std::string_view name, uint16_t qtype, uint16_t qclass = 1) {
+            next_section(section_t::question);
+            push_name(name);
+            push_word(qtype);
+            push_word(qclass);
+        }
+
+        void record(section_t section, std::string_view name, uint16_t rtype, uint16_t rclass,
+                    uint32_t ttl, std::string_view rdata) {
+            if (rdata.size() > 0xffff) { throw std::runtime_error("DNS rdata too long"); }
+            next_section(section);
+            push_name(name);
+            push_word(rtype);
+            push_word(rclass);
+            push_dword(ttl);
+            push_word(rdata.size());
+            buf.append(rdata);
+        }
+
+        // Record whose rdata is a single name (CNAME, NS, PTR), which gets compressed too
+        void name_record(section_t section, std::string_view name, uint16_t rtype, uint16_t rclass,
+                         uint32_t ttl, std::string_view target) {
+            next_section(section);
+            push_name(name);
+            push_word(rtype);
+            push_word(rclass);
+            push_dword(ttl);
+            const size_t rdlength_at = buf.size();
+            push_word(0);
+            push_name(target);
+            const size_t rdlength = buf.size() - rdlength_at - 2;
+            buf[rdlength_at] = rdlength >> 8;
+            buf[rdlength_at + 1] = rdlength;
+        }
+
+        std::string_view view() const { return buf; }
+
+    private:
+        void push_byte(uint8_t v) { buf.push_back(v); }
+        void push_word(uint16_t v) {
+            push_byte(v >> 8);
+            push_byte(v >> 0);
+        }
+        void push_dword(uint32_t v) {
+            push_word(v >> 16);
+            push_word(v >> 0);
+        }
+
+        void next_section(section_t section) {
+            if (section < current) { throw std::runtime_error("DNS records added out of section order"); }
+            current = section;
+            const size_t at = 4 + 2 * static_cast<size_t>(section);
+            const uint16_t n = (static_cast<uint8_t>(buf[at]) << 8 | static_cast<uint8_t>(buf[at + 1])) + 1;
+            if (n == 0) { throw std::runtime_error("too many DNS records"); }
+            buf[at] = n >> 8;
+            buf[at + 1] = n;
+        }
+
+        void push_name(std::string_view name) {
+            if (name.ends_with('.')) { name.remove_suffix(1); }
+            // Two bytes more on the wire: the first length and the root label
+            if (name.size() > max_name_size - 2) { throw std::runtime_error("bad domain name"); }
+            while (!name.empty()) {
+                if (auto offset = find_suffix(name)) {
+                    push_word(0b11000000'00000000u | *offset);
+                    return;
+                }
+                // Pointers hold 14 bits
+                if (buf.size() < 0b01000000'00000000u && n_suffixes < suffixes.size()) {
+                    suffixes[n_suffixes++] = {static_cast<uint16_t>(buf.size()), static_cast<uint8_t>(name.size())};
+                }
+                size_t dot = name.find('.');
+                if (dot == std::string_view::npos) { dot = name.size(); }
+                // https://www.rfc-editor.org/rfc/rfc1035#section-2.3.4
+                if (dot == 0 || dot > 63) { throw std::runtime_error("bad domain name"); }
+                push_byte(dot);
+                buf.append(name.substr(0, dot));
+                name.remove_prefix(std::min(dot + 1, name.size()));
+            }
+            push_byte('\0');
+        }
+
+        // Offset of an already written name equal to this one, compared exactly so case is kept
+        std::optional<uint16_t> find_suffix(std::string_view name) const {
+            for (size_t i = 0; i < n_suffixes; i++) {
+                const auto& suffix = suffixes[i];
+                if (suffix.size == name.size() && wire_equals(suffix.offset, name)) { return suffix.offset; }
+            }
+            return std::nullopt;
+        }
+
+        bool wire_equals(size_t pos, std::string_view name) const {
+            while (true) {
+                const uint8_t len = buf[pos];
+                if ((len & 0b11000000u) == 0b11000000u) {
+                    pos = (len & 0b00111111u) << 8 | static_cast<uint8_t>(buf[pos + 1]);
+                    continue;
+                }
+                if (len == 0) { return name.empty(); }
+                if (name.size() < len || std::string_view(buf).substr(pos + 1, len) != name.substr(0, len)) {
+                    return false;
+                }
+                name.remove_prefix(len);
+                if (!name.empty()) {
+                    if (name[0] != '.') { return false; }
+                    name.remove_prefix(1);
+                }
+                pos += 1 + len;
+            }
+        }
+
+        std::string& buf;
+        section_t current = section_t::question;
+        // Names and their suffixes written so far, targets for compression pointers
+        struct suffix_t {
+            uint16_t offset;
+            uint8_t size;   // In dotted form, checked before comparing labels
+        };
+        std::array<suffix_t, 64> suffixes;
+        size_t n_suffixes = 0;
+    };
+}
+
 // Out of line definitions
 namespace dns {
     inline std::string packet_t::str() const {
-        detail::serializer s;
-        s.push_packet(*this);
-        return std::move(s.buf);
+        std::string ret;
+        message_writer w(ret, id, flags);
+        for (const auto& q : questions) {
+            w.question(q.qname, q.qtype, q.qclass);
+        }
+        for (auto [section, rrs] : {std::pair{section_t::answer, &answer_RRs},
+                                    std::pair{section_t::authority, &authority_RRs},
+                                    std::pair{section_t::additional, &additional_RRs}}) {
+            for (const auto& rr : *rrs) {
+                w.record(section, rr.rname, rr.rtype, rr.rclass, rr.ttl, rr.rdata);
+            }
+        }
+        return ret;
     }
 
     inline packet_t packet_t::from_string(std::string_view s) {
         return detail::parser(s).packet();
     }
 
-    inline void packet_t::throw_rcode() const {
-        if (this->flags.rcode != rcode_t::no_error) {
-            throw std::runtime_error("DNS server error: " + std::string(rcode_to_string(this->flags.rcode)));
+    inline void throw_rcode(rcode_t rcode) {
+        if (rcode != rcode_t::no_error) {
+            throw std::runtime_error("DNS server error: " + std::string(rcode_to_string(rcode)));
         }
     }
+    inline void packet_t::throw_rcode() const {
+        dns::throw_rcode(this->flags.rcode);
+    }
 }
 
 // RR rdata converters
@@ -335,6 +669,24 @@ namespace dns {
         return std::move(s.buf);
     }
 
+    inline bool is_AAAA_RR(const resource_record_t& rr) {
+        return rr.rtype == 28 && rr.rclass == 1 && rr.rdata.size() == 16;
+    }
+
+    inline bool is_CNAME_RR(const resource_record_t& rr) {
+        return rr.rtype == 5 && rr.rclass == 1;
+    }
+
+    inline std::string from_CNAME_RR(const resource_record_t& rr) {
+        return detail::parser(rr.rdata).name();
+    }
+
+    inline std::string to_CNAME_RR(std::string_view host) {
+        detail::serializer s;
+        s.push_name(host);
+        return std::move(s.buf);
+    }
+
     inline bool is_PTR_RR(const resource_record_t& rr) {
         return rr.rtype == 12 && rr.rclass == 1;
     }
@@ -343,6 +695,26 @@ namespace dns {
         return detail::parser(rr.rdata).name();
     }
 
+    inline bool is_SOA_RR(const resource_record_t& rr) {
+        return rr.rtype == 6 && rr.rclass == 1;
+    }
+
+    // TTL for negative answers (NXDOMAIN / NODATA) carrying this SOA record, RFC 2308 section 5
+    inline uint32_t negative_ttl_from_SOA_RR(uint32_t ttl, std::string_view rdata) {
+        detail::parser p(rdata);
+        p.skip_name();  // MNAME
+        p.skip_name();  // RNAME
+        (void) p.dword();  // SERIAL
+        (void) p.dword();  // REFRESH
+        (void) p.dword();  // RETRY
+        (void) p.dword();  // EXPIRE
+        const uint32_t minimum = p.dword();
+        return std::min(ttl, minimum);
+    }
+    inline uint32_t negative_ttl_from_SOA_RR(const resource_record_t& rr) {
+        return negative_ttl_from_SOA_RR(rr.ttl, rr.rdata);
+    }
+
     inline std::string to_PTR_RR(std::string_view host) {
         detail::serializer s;
         s.push_name(host);
@@ -396,10 +768,11 @@ namespace dns {
         };
     }
 
-    inline packet_t standard_query(std::string_view host) {
+    // qtype 1 is A, 28 is AAAA
+    inline packet_t standard_query(std::string_view host, uint16_t qtype = 1) {
         return standard_query(question_t {
             .qname = std::string(host),
-            .qtype = 1,  // Type: A
+            .qtype = qtype,
             .qclass = 1,  // Class: IN
         });
     }
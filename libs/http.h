@@ -1,6 +1,121 @@
 #pragma once
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <vector>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace http::detail {
+    constexpr inline char ascii_lower(char c) {
+        return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+}
+
+namespace http {
+    // ASCII case-insensitive, for header names and tokens
+    constexpr inline bool iequal(std::string_view a, std::string_view b) {
+        if (a.size() != b.size()) { return false; }
+        // Usually spelled the same
+        if (a == b) { return true; }
+        for (size_t i = 0; i < a.size(); i++) {
+            if (detail::ascii_lower(a[i]) != detail::ascii_lower(b[i])) { return false; }
+        }
+        return true;
+    }
+}
+
+namespace http::detail {
+    // Header index slots in view, a power of 2
+    inline constexpr size_t header_table_size = 64;
+    // With more headers, view::get() scans instead of using the index
+    inline constexpr size_t max_indexed_headers = header_table_size * 3 / 4;
+
+    constexpr inline size_t header_slot(std::string_view name) {
+        // | 0x20 folds case, other characters only have to hash consistently
+        return (name.size() * 31 + (name.front() | 0x20) * 7 + (name.back() | 0x20)) & (header_table_size - 1);
+    }
+
+    // Bit i is set where s[i] is '\n' or ':', for up to 64 bytes
+    constexpr inline uint64_t delimiter_mask_scalar(std::string_view s) {
+        uint64_t ret = 0;
+        for (size_t i = 0; i < s.size() && i < 64; i++) {
+            if (s[i] == '\n' || s[i] == ':') { ret |= uint64_t(1) << i; }
+        }
+        return ret;
+    }
+
+    // Same for exactly 64 bytes at p
+    inline uint64_t delimiter_mask(const char* p) {
+#if defined(__AVX2__)
+        const __m256i lf = _mm256_set1_epi8('\n');
+        const __m256i colon = _mm256_set1_epi8(':');
+        uint64_t ret = 0;
+        for (int i = 0; i < 2; i++) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i * 32));
+            const __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, colon));
+            ret |= uint64_t(uint32_t(_mm256_movemask_epi8(hits))) << (i * 32);
+        }
+        return ret;
+#elif defined(__SSE2__)
+        const __m128i lf = _mm_set1_epi8('\n');
+        const __m128i colon = _mm_set1_epi8(':');
+        uint64_t ret = 0;
+        for (int i = 0; i < 4; i++) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i * 16));
+            const __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, colon));
+            ret |= uint64_t(uint16_t(_mm_movemask_epi8(hits))) << (i * 16);
+        }
+        return ret;
+#else
+        return delimiter_mask_scalar({p, 64});
+#endif
+    }
+
+    // Returns the positions of '\n' and ':' in order, classifying 64 bytes at a time
+    class delimiter_scanner {
+    public:
+        constexpr explicit delimiter_scanner(std::string_view s) : s(s) { load(0); }
+
+        // npos after the last one
+        constexpr size_t next() {
+            while (mask == 0) {
+                if (block + 64 >= s.size()) { return std::string_view::npos; }
+                load(block + 64);
+            }
+            const size_t ret = block + std::countr_zero(mask);
+            mask &= mask - 1;
+            return ret;
+        }
+        // The next '\n', skipping ':'
+        constexpr size_t next_line_end() {
+            size_t i = next();
+            while (i != std::string_view::npos && s[i] != '\n') {
+                i = next();
+            }
+            return i;
+        }
+
+    private:
+        constexpr void load(size_t at) {
+            block = at;
+            if (!std::is_constant_evaluated() && at + 64 <= s.size()) {
+                mask = delimiter_mask(s.data() + at);
+            } else {
+                mask = delimiter_mask_scalar(s.substr(at));
+            }
+        }
+
+        std::string_view s;
+        size_t block = 0;
+        uint64_t mask = 0;
+    };
+}
 
 namespace http {
     class view {
@@ -19,16 +134,17 @@ namespace http {
         std::vector<std::pair<std::string_view, std::string_view>> headers;
 
         constexpr explicit view(std::string_view full) : full(full) {
-            auto str = full;
-            auto consume_line = [&str] () {
-                auto lf = no_npos(str.find('\n'));
-                auto ret = str.substr(0, lf);
-                str = str.substr(lf + 1);
+            detail::delimiter_scanner scan(full);
+            headers.reserve(16);
+            size_t pos = 0;
+            // From pos to the line break at lf, moves pos past it
+            auto consume_line = [&] (size_t lf) {
+                auto ret = slice(full, pos, no_npos(lf));
+                pos = lf + 1;
                 trim_cr(ret);
                 return ret;
             };
-            status_line = consume_line();
-            trim_cr(status_line);
+            status_line = consume_line(scan.next_line_end());
             auto sp1 = no_npos(status_line.find(' ', 0));
             auto sp2 = no_npos(status_line.find(' ', sp1 + 1));
             auto word1 = slice(status_line, 0, sp1);
@@ -46,24 +162,45 @@ namespace http {
             }
             version_number = slice(version, no_npos(version.find('/')) + 1);
             while (true) {
-                auto l = consume_line();
-                if (l.empty()) { break; }
-                auto sep = no_npos(l.find(':'));
-                auto k = slice(l, 0, sep);
-                auto v = slice(l, sep + 1);
+                const size_t sep = no_npos(scan.next());
+                if (full[sep] == '\n') {
+                    // Only the empty line may lack a colon
+                    if (consume_line(sep).empty()) { break; }
+                    throw std::runtime_error("invalid http packet");
+                }
+                auto k = slice(full, pos, sep);
+                pos = sep + 1;
+                auto v = consume_line(scan.next_line_end());
                 while (v.starts_with(' ')) {
                     v = slice(v, 1);
                 }
                 headers.emplace_back(k, v);
+                if (!k.empty() && headers.size() <= detail::max_indexed_headers) {
+                    size_t slot = detail::header_slot(k);
+                    while (index[slot] != 0) { slot = (slot + 1) & (detail::header_table_size - 1); }
+                    index[slot] = uint8_t(headers.size());
+                }
             }
-            before_body = slice(full, 0, full.size() - str.size());
-            body = str;
+            before_body = slice(full, 0, pos);
+            body = slice(full, pos);
         }
         constexpr bool has(std::string_view header, std::string_view value = "") const {
             const auto v = get(header);
             return !v.empty() && (value.empty() || v == value);
         }
+        // First value of the header, empty if missing
         constexpr std::string_view get(std::string_view header) const {
+            if (!header.empty() && headers.size() <= detail::max_indexed_headers) {
+                // Headers with the same slot were added in order, so the first match is the first header
+                for (size_t slot = detail::header_slot(header); index[slot] != 0;
+                     slot = (slot + 1) & (detail::header_table_size - 1)) {
+                    const auto& [k, v] = headers[index[slot] - 1];
+                    if (iequal(k, header)) {
+                        return v;
+                    }
+                }
+                return std::string_view();
+            }
             for (const auto& [k, v] : headers) {
                 if (iequal(k, header)) {
                     return v;
@@ -73,18 +210,10 @@ namespace http {
         }
 
     private:
-        constexpr static bool iequal(std::string_view a, std::string_view b) {
-            const size_t sz1 = a.size();
-            const size_t sz2 = b.size();
-            if (sz1 != sz2) { return false; }
-            for (size_t i = 0; i < sz1; i++) {
-                // Good enough tolower for allowed HTTP chars
-                const char c1 = a[i] & 31;
-                const char c2 = b[i] & 31;
-                if (c1 != c2) { return false; }
-            }
-            return true;
-        }
+        // 1 + position in headers by detail::header_slot() of the name, 0 for empty slots.
+        // Collisions take the following free slot.
+        std::array<uint8_t, detail::header_table_size> index {};
+
         constexpr static size_t no_npos(size_t i) {
             if (i == -1ull) {
                 throw std::runtime_error("invalid http packet");
@@ -104,6 +233,401 @@ namespace http {
         }
     };
 
+    // Thrown by parser, distinct from malformed input so servers can answer 431
+    struct header_overflow : std::runtime_error {
+        header_overflow() : std::runtime_error("http headers too large") {}
+    };
+
+    enum class message_kind : uint8_t {
+        request,
+        response,
+    };
+
+    struct event {
+        enum type_t : uint8_t {
+            // All input was used, call again with more
+            need_more,
+            // method, target, version, status and reason are set
+            start_line,
+            // name and value are set
+            header,
+            // The body framing is known from here on
+            headers_done,
+            // data is the next part of the body, chunk framing removed
+            body,
+            // name and value are set, after the last chunk
+            trailer,
+            // The parser is ready for the next message on the connection
+            message_done,
+        };
+        type_t type = need_more;
+        std::string_view method;   // GET, requests only
+        std::string_view target;   // /index.html, requests only
+        std::string_view version;  // HTTP/1.1
+        unsigned status = 0;       // 404, responses only
+        std::string_view reason;   // Not Found, responses only
+        std::string_view name;
+        std::string_view value;
+        std::string_view data;
+    };
+
+    // Resumable HTTP/1.1 parser, fed with whatever input has arrived:
+    //
+    //     size_t used = parser.next(input, ev);
+    //     input.remove_prefix(used);
+    //
+    // Views in the event point into the input or the parser and stay valid until the next call.
+    // Only lines split across inputs are copied, body data never is.
+    // Throws std::runtime_error on malformed messages, header_overflow when
+    // headers or trailers are over max_header_bytes.
+    class parser {
+    public:
+        explicit parser(message_kind kind, size_t max_header_bytes = default_max_header_bytes)
+            : kind(kind), max_header_bytes(max_header_bytes) {}
+
+        size_t next(std::string_view data, event& ev) {
+            ev.type = event::need_more;
+            size_t used = 0;
+            while (ev.type == event::need_more && (used < data.size() || state == state_t::done)) {
+                used += step(data.substr(used), ev);
+            }
+            return used;
+        }
+
+        // Call when the connection is closed. Returns true if that ends a body delimited by EOF,
+        // which counts as message_done, and false between messages. Throws if a message was cut short.
+        bool eof() {
+            if (state == state_t::body_until_eof) {
+                reset();
+                return true;
+            }
+            if (state == state_t::start_line && (line_buf.empty() || line_done)) { return false; }
+            throw std::runtime_error("truncated http message");
+        }
+
+        // The response being parsed has no body regardless of its headers, as for HEAD requests
+        void expect_no_body() { no_body = true; }
+
+        // Valid after headers_done
+        bool chunked() const { return framing == framing_t::chunked; }
+        std::optional<uint64_t> content_length() const {
+            if (framing != framing_t::length) { return std::nullopt; }
+            return declared_length;
+        }
+        // Whether the connection can carry another message after this one
+        bool keep_alive() const { return keep_alive_flag; }
+
+        // Start line and headers together, or trailers, counted as received
+        static constexpr size_t default_max_header_bytes = 64 * 1024;
+
+    private:
+        enum class state_t : uint8_t {
+            start_line,
+            headers,
+            body_length,
+            chunk_size,
+            chunk_data,
+            chunk_data_end,
+            trailers,
+            body_until_eof,
+            done,
+        };
+        enum class framing_t : uint8_t {
+            none,
+            length,
+            chunked,
+            until_eof,
+        };
+
+        size_t step(std::string_view data, event& ev) {
+            size_t used = 0;
+            switch (state) {
+            case state_t::start_line:
+                if (auto line = take_line(data, used)) {
+                    // Empty lines before a message are allowed
+                    if (!line->empty()) {
+                        parse_start_line(*line, ev);
+                        state = state_t::headers;
+                    }
+                }
+                return used;
+            case state_t::headers:
+            case state_t::trailers:
+                if (auto line = take_line(data, used)) {
+                    if (line->empty()) {
+                        header_bytes = 0;
+                        if (state == state_t::headers) {
+                            start_body(ev);
+                        } else {
+                            state = state_t::done;
+                        }
+                    } else {
+                        parse_field(*line, ev);
+                        if (state == state_t::headers) {
+                            on_header(ev.name, ev.value);
+                        } else {
+                            ev.type = event::trailer;
+                        }
+                    }
+                }
+                return used;
+            case state_t::body_length:
+            case state_t::chunk_data: {
+                const size_t n = static_cast<size_t>(std::min<uint64_t>(length, data.size()));
+                length -= n;
+                ev.type = event::body;
+                ev.data = data.substr(0, n);
+                if (length == 0) {
+                    state = state == state_t::chunk_data ? state_t::chunk_data_end : state_t::done;
+                }
+                return n;
+            }
+            case state_t::chunk_data_end:
+                if (auto line = take_line(data, used)) {
+                    if (!line->empty()) {
+                        throw std::runtime_error("invalid http chunk");
+                    }
+                    header_bytes = 0;
+                    state = state_t::chunk_size;
+                }
+                return used;
+            case state_t::chunk_size:
+                if (auto line = take_line(data, used)) {
+                    length = parse_chunk_size(*line);
+                    header_bytes = 0;
+                    state = length == 0 ? state_t::trailers : state_t::chunk_data;
+                }
+                return used;
+            case state_t::body_until_eof:
+                ev.type = event::body;
+                ev.data = data;
+                return data.size();
+            case state_t::done:
+                ev.type = event::message_done;
+                reset();
+                return 0;
+            }
+            return 0;
+        }
+
+        // Returns nullopt and keeps the partial line if data has no '\n'
+        std::optional<std::string_view> take_line(std::string_view data, size_t& used) {
+            if (line_done) {
+                line_buf.clear();
+                line_done = false;
+            }
+            const size_t lf = data.find('\n');
+            const size_t n = lf == std::string_view::npos ? data.size() : lf + 1;
+            header_bytes += n;
+            if (header_bytes > max_header_bytes) {
+                throw header_overflow();
+            }
+            used = n;
+            if (lf == std::string_view::npos) {
+                line_buf.append(data);
+                return std::nullopt;
+            }
+            std::string_view line = data.substr(0, lf);
+            if (!line_buf.empty()) {
+                line_buf.append(line);
+                line = line_buf;
+                line_done = true;
+            }
+            if (line.ends_with('\r')) {
+                line.remove_suffix(1);
+            }
+            return line;
+        }
+
+        void parse_start_line(std::string_view line, event& ev) {
+            const size_t sp1 = line.find(' ');
+            const size_t sp2 = sp1 == std::string_view::npos ? sp1 : line.find(' ', sp1 + 1);
+            if (sp1 == std::string_view::npos || (sp2 == std::string_view::npos && kind == message_kind::request)) {
+                throw std::runtime_error("invalid http start line");
+            }
+            const std::string_view word1 = line.substr(0, sp1);
+            const std::string_view word2 = line.substr(sp1 + 1, sp2 - sp1 - 1);
+            const std::string_view rest = sp2 == std::string_view::npos ? std::string_view() : line.substr(sp2 + 1);
+            ev = {};
+            ev.type = event::start_line;
+            if (kind == message_kind::request) {
+                ev.method = word1;
+                ev.target = word2;
+                ev.version = rest;
+            } else {
+                ev.version = word1;
+                if (word2.size() != 3 || !is_digit(word2[0]) || !is_digit(word2[1]) || !is_digit(word2[2])) {
+                    throw std::runtime_error("invalid http status");
+                }
+                ev.status = (word2[0] - '0') * 100 + (word2[1] - '0') * 10 + (word2[2] - '0');
+                ev.reason = rest;
+                status = ev.status;
+            }
+            if (ev.version.size() != 8 || !ev.version.starts_with("HTTP/1.") || !is_digit(ev.version[7])) {
+                throw std::runtime_error("unsupported http version");
+            }
+            keep_alive_flag = ev.version[7] != '0';
+        }
+
+        void parse_field(std::string_view line, event& ev) {
+            const size_t colon = line.find(':');
+            if (colon == 0 || colon == std::string_view::npos || is_ows(line[0]) || is_ows(line[colon - 1])) {
+                throw std::runtime_error("invalid http header");
+            }
+            std::string_view value = line.substr(colon + 1);
+            while (!value.empty() && is_ows(value.front())) { value.remove_prefix(1); }
+            while (!value.empty() && is_ows(value.back())) { value.remove_suffix(1); }
+            ev = {};
+            ev.type = event::header;
+            ev.name = line.substr(0, colon);
+            ev.value = value;
+        }
+
+        void on_header(std::string_view name, std::string_view value) {
+            if (iequal(name, "Content-Length")) {
+                uint64_t n = 0;
+                if (value.empty() || value.size() > 18) {
+                    throw std::runtime_error("invalid http content length");
+                }
+                for (char c : value) {
+                    if (!is_digit(c)) { throw std::runtime_error("invalid http content length"); }
+                    n = n * 10 + (c - '0');
+                }
+                if (has_length && n != declared_length) {
+                    throw std::runtime_error("conflicting http content lengths");
+                }
+                has_length = true;
+                declared_length = n;
+            } else if (iequal(name, "Transfer-Encoding")) {
+                // Only the last coding matters for framing
+                has_transfer_encoding = true;
+                const size_t comma = value.rfind(',');
+                std::string_view last = comma == std::string_view::npos ? value : value.substr(comma + 1);
+                while (!last.empty() && is_ows(last.front())) { last.remove_prefix(1); }
+                last_coding_chunked = iequal(last, "chunked");
+            } else if (iequal(name, "Connection")) {
+                for_each_token(value, [&] (std::string_view token) {
+                    if (iequal(token, "close")) { keep_alive_flag = false; }
+                    if (iequal(token, "keep-alive")) { keep_alive_flag = true; }
+                });
+            }
+        }
+
+        // RFC 9112 section 6.3
+        void start_body(event& ev) {
+            ev = {};
+            ev.type = event::headers_done;
+            const bool bodiless_status = kind == message_kind::response
+                && (status / 100 == 1 || status == 204 || status == 304);
+            if (no_body || bodiless_status) {
+                framing = framing_t::none;
+            } else if (has_transfer_encoding) {
+                // With a Content-Length too the sender may frame it differently, don't read
+                // another message from this connection. RFC 9112 section 6.1
+                if (has_length) { keep_alive_flag = false; }
+                if (last_coding_chunked) {
+                    framing = framing_t::chunked;
+                } else if (kind == message_kind::request) {
+                    throw std::runtime_error("http request body length unknown");
+                } else {
+                    framing = framing_t::until_eof;
+                }
+            } else if (has_length) {
+                framing = framing_t::length;
+            } else {
+                framing = kind == message_kind::request ? framing_t::none : framing_t::until_eof;
+            }
+            switch (framing) {
+            case framing_t::none:
+                state = state_t::done;
+                break;
+            case framing_t::length:
+                length = declared_length;
+                state = length == 0 ? state_t::done : state_t::body_length;
+                break;
+            case framing_t::chunked:
+                state = state_t::chunk_size;
+                break;
+            case framing_t::until_eof:
+                state = state_t::body_until_eof;
+                keep_alive_flag = false;
+                break;
+            }
+        }
+
+        static uint64_t parse_chunk_size(std::string_view line) {
+            uint64_t n = 0;
+            size_t i = 0;
+            for (; i < line.size(); i++) {
+                const char c = line[i];
+                int digit;
+                if (is_digit(c)) {
+                    digit = c - '0';
+                } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+                    digit = (c | 0x20) - 'a' + 10;
+                } else {
+                    break;
+                }
+                if (i == 15) { throw std::runtime_error("http chunk too large"); }
+                n = n * 16 + digit;
+            }
+            // Chunk extensions are ignored
+            while (i < line.size() && is_ows(line[i])) { i++; }
+            if (i == 0 || (i < line.size() && line[i] != ';')) {
+                throw std::runtime_error("invalid http chunk size");
+            }
+            return n;
+        }
+
+        template <typename F>
+        static void for_each_token(std::string_view list, F f) {
+            while (!list.empty()) {
+                const size_t comma = list.find(',');
+                std::string_view token = list.substr(0, comma);
+                while (!token.empty() && is_ows(token.front())) { token.remove_prefix(1); }
+                while (!token.empty() && is_ows(token.back())) { token.remove_suffix(1); }
+                f(token);
+                if (comma == std::string_view::npos) { break; }
+                list.remove_prefix(comma + 1);
+            }
+        }
+
+        static constexpr bool is_digit(char c) { return c >= '0' && c <= '9'; }
+        static constexpr bool is_ows(char c) { return c == ' ' || c == '\t'; }
+
+        void reset() {
+            state = state_t::start_line;
+            framing = framing_t::none;
+            length = 0;
+            declared_length = 0;
+            header_bytes = 0;
+            status = 0;
+            has_length = false;
+            has_transfer_encoding = false;
+            last_coding_chunked = false;
+            no_body = false;
+        }
+
+        message_kind kind;
+        size_t max_header_bytes;
+        state_t state = state_t::start_line;
+        framing_t framing = framing_t::none;
+        // Body or chunk bytes left
+        uint64_t length = 0;
+        uint64_t declared_length = 0;
+        size_t header_bytes = 0;
+        unsigned status = 0;
+        bool has_length = false;
+        bool has_transfer_encoding = false;
+        bool last_coding_chunked = false;
+        bool no_body = false;
+        bool keep_alive_flag = true;
+        // A line split across inputs
+        std::string line_buf;
+        // line_buf holds a line that was returned and is cleared on the next take_line()
+        bool line_done = false;
+    };
+
     [[nodiscard]]
     constexpr inline std::string encode_uri(std::string_view s) {
         std::string ret;
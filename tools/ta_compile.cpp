@@ -0,0 +1,30 @@
+// Compiles a PEM certificate bundle into a trust store that
+// async::tls can map without decoding, see async/trust_store.h.
+// Usage: ta_compile <bundle.pem> <output>
+// Point ASYNC2_TRUST_STORE at the output to make it the default.
+#include <fmt.h>
+#include <ex.h>
+#include "../async/tls.h"
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        prn("usage:", argv[0], "<bundle.pem> <output>");
+        return 1;
+    }
+    try {
+        const auto pem = async::c_api::mmap_file(argv[1]);
+        const auto list = async::tls::detail::pem_to_ta_list(pem.view());
+        const std::string data = async::tls::trust_store::serialize(list.tas);
+        // Check that it loads
+        (void) async::tls::trust_store::from_bytes(data);
+        async::c_api::fd fd = async::c_api::creat(argv[2], 00644);
+        std::string_view left = data;
+        while (!left.empty()) {
+            left = left.substr(async::c_api::write(fd, left));
+        }
+        prn(list.tas.size(), "trust anchors written to", argv[2]);
+    } catch (const std::exception& e) {
+        prn("error:", e.what());
+        return 1;
+    }
+}